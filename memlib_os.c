@@ -0,0 +1,352 @@
+/**
+ * @file memlib_os.c
+ * @brief The memlib.h interface on top of real memory, for the LIBMM build
+ *
+ * mm.c expects a single heap that only grows at its end, which the lab's
+ * memlib.c simulates inside a malloc'd array. Here the heap is one large
+ * PROT_NONE mapping reserved at the first mem_sbrk() call; growing the heap
+ * makes the next pages readable and writable, in commit_step increments so
+ * that small extensions do not each cost a system call. The reservation
+ * takes address space only, so the heap stays contiguous without touching
+ * the program break that other code in the process may also move.
+ *
+ * mem_init_file() maps a file over the reservation instead, for heaps that
+ * outlive the process or are shared with others (see memlib_os.h). The
+ * whole reservation is mapped at once and growing the heap only extends the
+ * file, so the file is always exactly as large as the heap.
+ *
+ * @author Yi-Jing <ysie@andrew.cmu.edu>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "memlib_os.h"
+
+/** @brief Address space reserved for the heap (bytes) */
+static const size_t reserve_size = (size_t)1 << 36;
+
+/** @brief Smallest reservation to fall back to (bytes) */
+static const size_t min_reserve_size = (size_t)1 << 26;
+
+/** @brief Alignment of the heap, so that it can use transparent huge pages */
+static const size_t huge_page_size = (size_t)1 << 21;
+
+/** @brief Granularity in which pages are made accessible (bytes) */
+static const size_t commit_step = (size_t)1 << 16;
+
+static char *heap_lo = NULL;     // first byte of the heap
+static char *heap_brk = NULL;    // first byte past the heap
+static char *heap_commit = NULL; // first byte past the accessible pages
+static char *heap_end = NULL;    // first byte past the reservation
+static int heap_fd = -1;         // file holding the heap (-1: anonymous)
+static bool heap_shared = false; // whether other processes map the file
+static char *fork_copy = NULL;   // the heap as a child of fork() gets it
+static size_t fork_size = 0;
+
+/**
+ * @brief Reserves the address space of the heap
+ *
+ * The reservation is halved until the system grants it, for processes with
+ * a limit on their address space. It starts on a huge page boundary, and
+ * the excess reserved to get there is given back.
+ */
+void mem_init(void) {
+    if (heap_lo != NULL) {
+        return;
+    }
+    for (size_t size = reserve_size; size >= min_reserve_size; size /= 2) {
+        char *p = mmap(NULL, size + huge_page_size, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED) {
+            char *lo = (char *)(((uintptr_t)p + huge_page_size - 1) &
+                                ~(uintptr_t)(huge_page_size - 1));
+            if (lo != p) {
+                munmap(p, (size_t)(lo - p));
+            }
+            munmap(lo + size, (size_t)(p + huge_page_size - lo));
+            heap_lo = heap_brk = heap_commit = lo;
+            heap_end = heap_lo + size;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Maps the heap from `path` at `base`
+ *
+ * The reservation covers the pages past the end of the file as well; they
+ * are never touched before mem_sbrk() has extended the file over them.
+ */
+bool mem_init_file(const char *path, void *base, size_t reserve, bool shared) {
+    if (heap_lo != NULL) {
+        return false;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    // A private heap has no lock shared between processes, so one process at
+    // a time; a shared one waits for the process setting it up
+    int lock = shared ? LOCK_EX : LOCK_EX | LOCK_NB;
+    struct stat st;
+    if (flock(fd, lock) != 0 || fstat(fd, &st) != 0 ||
+        (size_t)st.st_size > reserve) {
+        close(fd);
+        return false;
+    }
+    int flags = MAP_SHARED | MAP_NORESERVE;
+    if (base != NULL) {
+        flags |= MAP_FIXED_NOREPLACE;
+    }
+    void *p = mmap(base, reserve, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (p == MAP_FAILED || (base != NULL && p != base)) {
+        // Kernels before 4.17 take the address as a hint only
+        if (p != MAP_FAILED) {
+            munmap(p, reserve);
+        }
+        close(fd);
+        return false;
+    }
+    heap_fd = fd;
+    heap_shared = shared;
+    heap_lo = p;
+    heap_brk = heap_lo + st.st_size;
+    heap_commit = heap_end = heap_lo + reserve;
+    return true;
+}
+
+/** @brief Releases the lock a shared heap file is set up under */
+void mem_file_ready(void) {
+    if (heap_shared) {
+        flock(heap_fd, LOCK_UN);
+    }
+}
+
+/** @brief Moves the end of a shared heap to where another process left it */
+void mem_set_heapsize(size_t size) {
+    heap_brk = heap_lo + size;
+}
+
+/**
+ * @brief Writes the dirty pages of a file-backed heap to the file
+ */
+bool mem_sync(void) {
+    if (heap_fd < 0) {
+        return false;
+    }
+    size_t size = (size_t)(heap_brk - heap_lo);
+    return size == 0 || msync(heap_lo, size, MS_SYNC) == 0;
+}
+
+/**
+ * @brief Copies a file-backed heap for the child of the coming fork()
+ */
+void mem_fork_prepare(void) {
+    if (heap_fd < 0 || heap_shared || heap_brk == heap_lo) {
+        return;
+    }
+    size_t page = mem_pagesize();
+    fork_size = ((size_t)(heap_brk - heap_lo) + page - 1) & ~(page - 1);
+    fork_copy = mmap(NULL, fork_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fork_copy == MAP_FAILED) {
+        fork_copy = NULL;
+        return;
+    }
+    memcpy(fork_copy, heap_lo, (size_t)(heap_brk - heap_lo));
+}
+
+/** @brief Drops the copy made for the child */
+void mem_fork_parent(void) {
+    if (fork_copy != NULL) {
+        munmap(fork_copy, fork_size);
+        fork_copy = NULL;
+    }
+}
+
+/**
+ * @brief Replaces the shared mapping of a file-backed heap by the private
+ * copy, and the rest of the reservation by anonymous memory
+ *
+ * A child without a copy (mmap() failed in the parent) aborts rather than
+ * write into the parent's heap.
+ */
+void mem_fork_child(void) {
+    if (heap_fd < 0 || heap_shared) {
+        return;
+    }
+    if (heap_brk != heap_lo &&
+        (fork_copy == NULL ||
+         mremap(fork_copy, fork_size, fork_size, MREMAP_MAYMOVE | MREMAP_FIXED,
+                heap_lo) == MAP_FAILED)) {
+        abort();
+    }
+    fork_copy = NULL;
+    heap_commit = heap_lo + fork_size;
+    mmap(heap_commit, (size_t)(heap_end - heap_commit), PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    close(heap_fd);
+    heap_fd = -1;
+}
+
+/**
+ * @brief Unmaps the heap
+ */
+void mem_deinit(void) {
+    if (heap_lo != NULL) {
+        munmap(heap_lo, (size_t)(heap_end - heap_lo));
+    }
+    if (heap_fd >= 0) {
+        close(heap_fd);
+        heap_fd = -1;
+        heap_shared = false;
+    }
+    heap_lo = heap_brk = heap_commit = heap_end = NULL;
+}
+
+/**
+ * @brief Empties the heap and gives its pages back to the system
+ */
+void mem_reset_brk(void) {
+    if (heap_lo == NULL) {
+        return;
+    }
+    if (heap_fd >= 0) {
+        if (ftruncate(heap_fd, 0) == 0) {
+            heap_brk = heap_lo;
+        }
+        return;
+    }
+    size_t size = (size_t)(heap_commit - heap_lo);
+    mmap(heap_lo, size, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    heap_brk = heap_commit = heap_lo;
+}
+
+/**
+ * @brief Grows the heap by `incr` bytes
+ * @param[in] incr number of bytes to add, not negative
+ * @return the old end of the heap, or (void *)-1 with errno set to ENOMEM
+ */
+void *mem_sbrk(intptr_t incr) {
+    if (heap_lo == NULL) {
+        mem_init();
+    }
+    if (heap_lo == NULL || incr < 0 ||
+        (size_t)incr > (size_t)(heap_end - heap_brk)) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    char *old_brk = heap_brk;
+    char *new_brk = heap_brk + incr;
+    if (heap_fd >= 0 && incr != 0 &&
+        ftruncate(heap_fd, (off_t)(new_brk - heap_lo)) != 0) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    if (new_brk > heap_commit) {
+        size_t commit = (size_t)(new_brk - heap_commit);
+        commit = (commit + commit_step - 1) & ~(commit_step - 1);
+        if (commit > (size_t)(heap_end - heap_commit)) {
+            commit = (size_t)(heap_end - heap_commit);
+        }
+        if (mprotect(heap_commit, commit, PROT_READ | PROT_WRITE) != 0) {
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        heap_commit += commit;
+    }
+    heap_brk = new_brk;
+    return old_brk;
+}
+
+/**
+ * @brief Counts the NUMA nodes from sysfs ("0" or "0-3"); machines or
+ * containers without it count as one node
+ *
+ * Reads the file without stdio, which would call malloc().
+ */
+unsigned int mem_numa_nodes(void) {
+    int fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    char buf[32];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 1;
+    }
+    buf[n] = '\0';
+    char *dash = strchr(buf, '-');
+    return dash != NULL ? (unsigned int)strtoul(dash + 1, NULL, 10) + 1 : 1;
+}
+
+/** @brief getcpu(), which the vDSO answers without entering the kernel */
+void mem_numa_where(unsigned int *node, unsigned int *thread) {
+    unsigned int cpu;
+    if (getcpu(&cpu, node) != 0) {
+        *node = 0;
+    }
+    if (thread != NULL) {
+        *thread = (unsigned int)gettid();
+    }
+}
+
+/**
+ * @brief mbind() with MPOL_PREFERRED rather than MPOL_BIND, so that a full
+ * node spills over to the others instead of failing page faults
+ */
+void mem_numa_bind(void *start, size_t size, unsigned int node) {
+    uintptr_t page = mem_pagesize();
+    uintptr_t lo = ((uintptr_t)start + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t)start + size) & ~(page - 1);
+    unsigned long mask = 1ul << node;
+    if (lo < hi && node < 8 * sizeof(mask)) {
+        syscall(SYS_mbind, lo, hi - lo, MPOL_PREFERRED, &mask,
+                8 * sizeof(mask), 0);
+    }
+}
+
+/** @brief Returns the address of the first heap byte */
+void *mem_heap_lo(void) {
+    return heap_lo;
+}
+
+/** @brief Returns the address of the last heap byte */
+void *mem_heap_hi(void) {
+    return heap_brk - 1;
+}
+
+/** @brief Returns the heap size in bytes */
+size_t mem_heapsize(void) {
+    return (size_t)(heap_brk - heap_lo);
+}
+
+/** @brief Returns the system's page size in bytes */
+size_t mem_pagesize(void) {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/** @brief memcpy(), which the lab's memlib.c instruments */
+void *mem_memcpy(void *dst, const void *src, size_t n) {
+    return memcpy(dst, src, n);
+}
+
+/** @brief memset(), which the lab's memlib.c instruments */
+void *mem_memset(void *dst, int c, size_t n) {
+    return memset(dst, c, n);
+}
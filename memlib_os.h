@@ -0,0 +1,97 @@
+/**
+ * @file memlib_os.h
+ * @brief The memlib.h interface as memlib_os.c implements it, and what it
+ * offers beyond it
+ *
+ * The lab's memlib.h is not needed for the library build: the functions it
+ * declares are declared here as well, with the same signatures.
+ *
+ * @author Yi-Jing <ysie@andrew.cmu.edu>
+ */
+
+#ifndef MEMLIB_OS_H
+#define MEMLIB_OS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The memlib.h interface. mem_init() reserves the address space of the heap
+ * (mem_sbrk() does it too if needed), mem_deinit() unmaps it, and
+ * mem_reset_brk() empties the heap and gives its pages back.
+ */
+void mem_init(void);
+void mem_deinit(void);
+void *mem_sbrk(intptr_t incr);
+void mem_reset_brk(void);
+void *mem_heap_lo(void);
+void *mem_heap_hi(void);
+size_t mem_heapsize(void);
+size_t mem_pagesize(void);
+void *mem_memcpy(void *dst, const void *src, size_t n);
+void *mem_memset(void *dst, int c, size_t n);
+
+/**
+ * @brief Places the heap in a file, mapped shared.
+ *
+ * Must come before the first mem_sbrk(). The heap then starts with the
+ * contents of the file (mem_heapsize() is its size, 0 for a new file), and
+ * the file grows with the heap.
+ *
+ * A private file is locked to this process. A `shared` one may be mapped by
+ * several processes at once, each at its own address, and is locked only
+ * until mem_file_ready(), so that one process at a time sets it up; its heap
+ * size is then kept by the caller (mem_set_heapsize()), and children of
+ * fork() keep sharing it.
+ *
+ * @param[in] path the file, created if missing
+ * @param[in] base page-aligned address to map it at, NULL for any
+ * @param[in] reserve address space reserved for the heap (bytes)
+ * @param[in] shared whether other processes may map the file too
+ * @return false if the file cannot be opened, another process has it open
+ * (private files), or `base` is taken
+ */
+bool mem_init_file(const char *path, void *base, size_t reserve, bool shared);
+
+/** @brief Lets other processes open a shared heap file */
+void mem_file_ready(void);
+
+/**
+ * @brief Sets the size of a shared heap, as another process left it
+ * @param[in] size a size the file has already been extended to
+ */
+void mem_set_heapsize(size_t size);
+
+/** @brief Writes the heap back to its file; false if it has none */
+bool mem_sync(void);
+
+/** @brief Returns the number of NUMA nodes of the machine, at least 1 */
+unsigned int mem_numa_nodes(void);
+
+/**
+ * @brief Tells where the calling thread runs
+ * @param[out] node the NUMA node of its CPU
+ * @param[out] thread its thread id, unless NULL (a system call)
+ */
+void mem_numa_where(unsigned int *node, unsigned int *thread);
+
+/**
+ * @brief Makes the pages of part of the heap prefer a NUMA node when they
+ * are first touched
+ * @param[in] start start of the range, rounded up to a page
+ * @param[in] size bytes in the range
+ * @param[in] node a node below mem_numa_nodes()
+ */
+void mem_numa_bind(void *start, size_t size, unsigned int node);
+
+/*
+ * fork() handlers, called with the heap quiescent. A child gets a private
+ * copy of a private file-backed heap, taken in the parent before the fork,
+ * so that it does not allocate into the parent's file.
+ */
+void mem_fork_prepare(void);
+void mem_fork_parent(void);
+void mem_fork_child(void);
+
+#endif /* MEMLIB_OS_H */
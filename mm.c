@@ -19,17 +19,33 @@
  * @author Yi-Jing <ysie@andrew.cmu.edu>
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <malloc.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
+#ifdef LIBMM
+// The library build needs none of the lab's files: memlib_os.h declares the
+// memlib.h interface, and the C library headers the malloc() family
+#include "memlib_os.h"
+#else
 #include "memlib.h"
 #include "mm.h"
+#endif
+#include "mm_ext.h"
 
 /* Do not change the following! */
 
@@ -45,6 +61,23 @@
 
 /* You can change anything from here onward */
 
+#ifdef DRIVER
+/* aliases for the entry points mm.h does not declare */
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define memalign mm_memalign
+#define valloc mm_valloc
+#define pvalloc mm_pvalloc
+#define malloc_usable_size mm_malloc_usable_size
+#endif /* def DRIVER */
+
+/*
+ * If LIBMM is defined, mm.c is built as a drop-in replacement for the C
+ * library's malloc (see README.md): memlib_os.c provides mem_sbrk() on top of
+ * a real mapping and every entry point takes one global heap lock.
+ */
+#include <pthread.h>
+
 /*
  *****************************************************************************
  * If DEBUG is defined (such as when running mdriver-dbg), these macros      *
@@ -74,19 +107,65 @@
 
 /* Basic constants */
 
+/*
+ * If COMPACT_HEADER is defined, headers and footers are 4 bytes instead of 8.
+ * Block sizes then have to fit in 32 bits, so the heap is capped at 4 GiB,
+ * but every allocated block carries 4 fewer bytes of overhead: requests of
+ * 9-12 bytes fit in a 16-byte miniblock and sizes with 9-12 bytes past a
+ * multiple of 16 save a whole dsize.
+ */
+#ifdef COMPACT_HEADER
+typedef uint32_t word_t;
+#else
 typedef uint64_t word_t;
+#endif
 
 /** @brief Word and header size (bytes) */
 static const size_t wsize = sizeof(word_t);
 
-/** @brief Double word size (bytes) */
-static const size_t dsize = 2 * wsize;
+/** @brief Double word size (bytes), which is also the payload alignment */
+static const size_t dsize = 2 * sizeof(uint64_t);
 
 /** @brief Minimum block size (bytes) */
 static const size_t min_block_size = 2 * dsize;
 
-/** @brief Mnimum chunk size (bytes) */
-static const size_t chunksize = (1 << 12);
+/*
+ * The constants that size arrays are enum constants, as in C a static const
+ * object is not a constant expression.
+ */
+
+/** @brief Block sizes whose class is looked up in class_table (bytes) */
+enum { class_table_limit = 1 << 12 };
+
+/** @brief Size of a transparent huge page (bytes) */
+static const size_t huge_page_size = (size_t)1 << 21;
+
+/*
+ * If COMPACT_LINKS is defined, free-list links are 32-bit offsets from the
+ * start of the heap instead of full pointers. A free miniblock then has room
+ * for a prev link as well, so minilist becomes doubly linked like seglist and
+ * removing a miniblock no longer walks the list. Offsets need the heap to fit
+ * in 4 GiB, which COMPACT_HEADER already guarantees, so it turns this on too.
+ */
+#if defined(COMPACT_HEADER) && !defined(COMPACT_LINKS)
+#define COMPACT_LINKS
+#endif
+
+/*
+ * If PREFETCH is defined, the free-list scans and free() issue software
+ * prefetches for the blocks they are about to touch (see prefetch()), so
+ * that the cache misses of walking a large heap overlap with useful work
+ * instead of being taken one at a time.
+ */
+
+#ifdef COMPACT_LINKS
+typedef uint32_t link_t;
+
+/** @brief Largest heap whose offsets and sizes fit in 32 bits */
+static const size_t max_heap_size = (size_t)1 << 32;
+#else
+typedef struct block *link_t;
+#endif
 
 /**
  * @brief A mask to get the bit from a word
@@ -96,41 +175,160 @@ static const word_t alloc_mask_pre = 0x2; // previous block allocation bit
 static const word_t mini_mask_pre = 0x4;  // previous miniblock allocation bit
 static const word_t size_mask = ~(word_t)0xF; // block size bits
 
-/** @brief Represents the header and payload of one block in the heap */
+/**
+ * @brief Represents the header and payload of one block in the heap
+ *
+ * Free blocks keep their free-list links at the start of the payload (see
+ * get_next()/set_next()). With a 4-byte header the links are not 8-byte
+ * aligned, so they are not struct members but are read and written with
+ * __builtin_memcpy, which compiles to a plain load/store (and, unlike
+ * memcpy, is not redirected to mem_memcpy by the driver aliases).
+ */
 typedef struct block {
     /** @brief Header contains size + allocation flag */
     word_t header;
-    // A union for pointer arithmetic
-    union {
-        /* next and previous block pointer */
-        struct {
-            struct block *next;
-            struct block *prev;
-        };
-        /** @brief A pointer to the block payload.*/
-        char payload[0];
-    };
-
+    /** @brief A pointer to the block payload.*/
+    char payload[0];
 } block_t;
 
 /* Mini block */
 // All the miniblock have the same size so only next pointer is needed
-typedef struct mini_block {
-    word_t header;
-    union {
-        struct mini_block *next;
-        char payload[0];
-    };
-
-} miniblock_t;
+typedef block_t miniblock_t;
 
 /* Global variables */
 /** @brief Pointer to first block in the heap */
 static void *heap_start = NULL;
-// Number of the list
-static const size_t num_lists = 12;
+#ifdef COMPACT_LINKS
+/** @brief Start of the heap, which compact links are relative to */
+static char *link_base = NULL;
+#endif
+// Most size classes a policy may have
+enum { num_lists = 32 };
 static block_t *seglist[num_lists];
 static miniblock_t *mini_list;
+// Root of the tree that replaces seglist[tree_class]
+static block_t *large_root;
+// Policy for the next mm_init() and the current one (see mm_set_policy())
+static const mm_policy_t *policy_next = NULL;
+static mm_policy_t policy;
+// Copy of the policy passed to mm_set_policy() or found in a heap image
+static mm_policy_t policy_custom;
+// The last size class, kept in the tree
+static size_t tree_class;
+// log2 of policy.class_steps
+static unsigned int class_steps_log;
+// Size class of every block size below class_table_limit, by size / dsize
+static uint8_t class_table[class_table_limit / (2 * sizeof(uint64_t))];
+// Classes whose list is kept in address order (bit i for seglist[i])
+static unsigned int addr_order_next = 0;
+static unsigned int addr_order = 0;
+// The block last inserted into each address-ordered list
+static block_t *seg_hint[num_lists];
+// Hardening policy for the next mm_init() (see mm_set_hardening())
+static unsigned int harden_next = 0;
+static unsigned int guard_interval_next = 0;
+// Whether pointers passed to free() and realloc() are checked
+static bool harden = false;
+// Bytes reserved at the end of allocated blocks for the canary (0: none)
+static size_t canary_size = 0;
+// Bytes reserved for the allocation site (0: not recorded)
+static size_t site_size = 0;
+// Total bytes of the block trailer: site and canary
+static size_t trailer_size = 0;
+// Per-heap key mixed into every canary
+static uint64_t canary_secret;
+// One malloc() in guard_interval gets a guard page (0: never)
+static unsigned int guard_interval = 0;
+static unsigned int guard_countdown = 0;
+// The span of the guard pages set since mm_init(), on the heap that starts
+// at guard_base; blocks still allocated at a reset keep theirs PROT_NONE
+static char *guard_base = NULL;
+static char *guard_lo = NULL;
+static char *guard_hi = NULL;
+// Whether the heap grows in whole huge pages, for the next mm_init() and
+// the current one
+static bool huge_pages_next = false;
+static bool huge_pages = false;
+// Quarantine limit for the next mm_init() and the current one (0: off)
+static size_t quarantine_max_next = 0;
+static size_t quarantine_max = 0;
+// FIFO ring of quarantined blocks, allocated from the heap by the first free
+static block_t **quarantine_ring;
+static size_t quarantine_cap;
+static size_t quarantine_head;
+static size_t quarantine_count;
+// Sum of the sizes of the quarantined blocks
+static size_t quarantine_bytes;
+// Pattern written over the payloads of quarantined blocks
+static uint64_t poison_word;
+// Number of heaps initialized with a quarantine, which keys poison_word so
+// that the poison left by the blocks of a previous heap does not match it
+static uint64_t poison_epoch = 0;
+// Heap size past which memory pressure is signalled, and heap size that
+// is never passed (0: no limit), see mm_set_heap_limit()
+static size_t heap_soft_limit = 0;
+static size_t heap_hard_limit = 0;
+// Whether mm_init() gives the heap a maintenance thread (see MAINTENANCE),
+// whether the current heap has one, and whether it is running
+static bool maint_next = false;
+static bool maint_wanted = false;
+static bool maint_running = false;
+// Whether the maintenance thread has free pages to give back
+static bool decommit_due = false;
+// Serializes the calls into the heap (every call under LIBMM, and while
+// the maintenance thread runs otherwise)
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Start of a heap image or shared heap: what another process needs
+ * to allocate on the heap (see HEAP IMAGES below). Blocks are recorded by
+ * their offset from the header, 0 standing for NULL.
+ */
+typedef struct {
+    /** @brief image_magic while the fields below match the heap, or
+     * shm_magic for a shared heap */
+    uint64_t magic;
+    /** @brief image_layout of the mm.c that wrote the image */
+    uint64_t layout;
+    /** @brief Address the heap is mapped at (images only) */
+    void *base;
+    /** @brief mem_heapsize() when the image was saved, or now */
+    size_t heap_size;
+    /** @brief The program's own root object (mm_set_image_root()) */
+    uint64_t root;
+    /** @brief The free-list roots */
+    uint64_t seglist[num_lists];
+    uint64_t seg_hint[num_lists];
+    uint64_t mini_list;
+    uint64_t large_root;
+    /** @brief The settings the blocks were laid out with */
+    mm_policy_t policy;
+    unsigned int addr_order;
+    unsigned int harden;
+    unsigned int guard_interval;
+    size_t quarantine_max;
+    uint64_t canary_secret;
+    /** @brief The quarantine, whose ring is in the heap */
+    block_t **quarantine_ring;
+    size_t quarantine_cap;
+    size_t quarantine_head;
+    size_t quarantine_count;
+    size_t quarantine_bytes;
+    uint64_t poison_word;
+#ifdef LIBMM
+    /** @brief Serializes the processes sharing the heap */
+    pthread_mutex_t lock;
+#endif
+} image_header_t;
+
+// Header of the heap image, at the start of the heap (NULL: no image)
+static image_header_t *image = NULL;
+#ifdef LIBMM
+// Whether other processes use the heap at the same time (MM_SHM)
+static bool image_shared = false;
+// Whether this process holds image->lock
+static bool image_locked = false;
+#endif
 // static bool flag = false;
 // static bool implicit = false;
 
@@ -164,6 +362,28 @@ static size_t max(size_t x, size_t y) {
     return (x > y) ? x : y;
 }
 
+/**
+ * @brief Returns the minimum of two integers.
+ * @param[in] x one of the number to be compared
+ * @param[in] y the other number to be compared
+ * @return `x` if `x < y`, and `y` otherwise.
+ */
+static size_t min(size_t x, size_t y) {
+    return (x < y) ? x : y;
+}
+
+/**
+ * @brief Starts loading the cache line at `p`, under PREFETCH
+ * @param[in] p any address; prefetches never fault, so NULL is fine
+ */
+static void prefetch(const void *p) {
+#ifdef PREFETCH
+    __builtin_prefetch(p);
+#else
+    (void)p;
+#endif
+}
+
 /**
  * @brief Rounds `size` up to the multiple of n
  * @param[in] size The original size to be rounded up
@@ -257,7 +477,7 @@ static void *header_to_payload(block_t *block) {
 static word_t *header_to_footer(block_t *block) {
     dbg_requires(get_size(block) != 0 &&
                  "Called header_to_footer on the boundary block");
-    return (word_t *)(block->payload + get_size(block) - dsize);
+    return (word_t *)((char *)block + get_size(block) - wsize);
 }
 
 /**
@@ -348,6 +568,135 @@ bool get_mini(void *block) {
     return extract_mini(((block_t *)block)->header);
 }
 
+/**
+ * @brief Decodes a free-list link into a block pointer
+ *
+ * Offset 0 is the padding before the prologue, which is never a block, so it
+ * stands for NULL.
+ *
+ * @param[in] link the stored link
+ * @return the block it refers to, or NULL
+ */
+static block_t *link_to_block(link_t link) {
+#ifdef COMPACT_LINKS
+    return link == 0 ? NULL : (block_t *)(link_base + link);
+#else
+    return link;
+#endif
+}
+
+/**
+ * @brief Encodes a block pointer as a free-list link
+ * @param[in] block the block to refer to, or NULL
+ * @return the link to store
+ */
+static link_t block_to_link(block_t *block) {
+#ifdef COMPACT_LINKS
+    return block == NULL ? 0 : (link_t)((char *)block - link_base);
+#else
+    return block;
+#endif
+}
+
+/**
+ * @brief Reads one of the links stored in the payload of a free block
+ * @param[in] block a free block
+ * @param[in] slot which link to read (0 is the first word of the payload)
+ * @return the block the link refers to
+ */
+static block_t *get_link(block_t *block, size_t slot) {
+    link_t link;
+    __builtin_memcpy(&link, block->payload + slot * sizeof(link),
+                     sizeof(link));
+    return link_to_block(link);
+}
+
+/**
+ * @brief Writes one of the links stored in the payload of a free block
+ * @param[out] block a free block
+ * @param[in] slot which link to write
+ * @param[in] target the block the link refers to
+ */
+static void set_link(block_t *block, size_t slot, block_t *target) {
+    link_t link = block_to_link(target);
+    __builtin_memcpy(block->payload + slot * sizeof(link), &link,
+                     sizeof(link));
+}
+
+/**
+ * @brief Reads the next free-list link of a free block
+ * @param[in] block a free block
+ * @return the next block in its free list
+ */
+static block_t *get_next(block_t *block) {
+    return get_link(block, 0);
+}
+
+/**
+ * @brief Writes the next free-list link of a free block
+ * @param[out] block a free block
+ * @param[in] next the next block in its free list
+ */
+static void set_next(block_t *block, block_t *next) {
+    set_link(block, 0, next);
+}
+
+/**
+ * @brief Reads the previous free-list link of a free block (a miniblock
+ * only has one with COMPACT_LINKS)
+ * @param[in] block a free block
+ * @return the previous block in its free list
+ */
+static block_t *get_prev(block_t *block) {
+    return get_link(block, 1);
+}
+
+/**
+ * @brief Writes the previous free-list link of a free block (a miniblock
+ * only has one with COMPACT_LINKS)
+ * @param[out] block a free block
+ * @param[in] prev the previous block in its free list
+ */
+static void set_prev(block_t *block, block_t *prev) {
+    set_link(block, 1, prev);
+}
+
+/*
+ * Blocks of the largest size class are kept in a tree instead of a list.
+ * mm_set_policy() only accepts policies whose tree class starts at a size
+ * with room for the three links, between the header and the footer.
+ */
+
+/** @brief Reads the left child of a large free block */
+static block_t *get_left(block_t *block) {
+    return get_link(block, 0);
+}
+
+/** @brief Writes the left child of a large free block */
+static void set_left(block_t *block, block_t *left) {
+    set_link(block, 0, left);
+}
+
+/** @brief Reads the right child of a large free block */
+static block_t *get_right(block_t *block) {
+    return get_link(block, 1);
+}
+
+/** @brief Writes the right child of a large free block */
+static void set_right(block_t *block, block_t *right) {
+    set_link(block, 1, right);
+}
+
+/** @brief Reads the parent of a large free block */
+static block_t *get_parent(block_t *block) {
+    return get_link(block, 2);
+}
+
+/** @brief Writes the parent of a large free block */
+static void set_parent(block_t *block, block_t *parent) {
+    set_link(block, 2, parent);
+}
+
 /**
  * @brief Writes a block starting at the given address.
  *
@@ -411,7 +760,7 @@ static block_t *find_next_free(block_t *block) {
                  "Called find_next on boundary block in the heap");
     dbg_assert(!get_alloc(block) &&
                "Block is not int the free list when calling find_next_free.\n");
-    block_t *next_free = block->next;
+    block_t *next_free = get_next(block);
     return (next_free);
 }
 
@@ -436,9 +785,11 @@ static word_t *find_prev_footer(block_t *block) {
  * If the function is called on the first block in the heap, NULL will be
  * returned, since the first block in the heap has no previous block!
  *
- * The position of the previous block is found by reading the previous
- * block's footer to determine its size, then calculating the start of the
- * previous block based on its size.
+ * A miniblock has no footer, so if the mini bit says the previous block is a
+ * miniblock it simply starts dsize bytes earlier. Otherwise the position of
+ * the previous block is found by reading the previous block's footer to
+ * determine its size, then calculating the start of the previous block based
+ * on its size. Either way the previous block must be free.
  *
  * @param[in] block A block in the heap
  * @return The previous consecutive block in the heap.
@@ -448,6 +799,9 @@ static word_t *find_prev_footer(block_t *block) {
 static block_t *find_prev(block_t *block) {
     dbg_requires(block != NULL);
     dbg_requires(get_size(block) != 0 && "Called find_prev on boundaries\n");
+    if (get_mini(block)) {
+        return (block_t *)((char *)block - dsize);
+    }
     word_t *footerp = find_prev_footer(block);
     // Return NULL if called on first block in the heap
     if (extract_size(*footerp) == 0) {
@@ -456,6 +810,14 @@ static block_t *find_prev(block_t *block) {
     return footer_to_header(footerp);
 }
 
+/**
+ * @brief Finds the epilogue header, which is the last word of the heap.
+ * @return The epilogue
+ */
+static block_t *find_epilogue(void) {
+    return (block_t *)((char *)mem_heap_hi() + 1 - wsize);
+}
+
 /**
  * @brief Writes an epilogue header at the given address.
  *
@@ -464,7 +826,7 @@ static block_t *find_prev(block_t *block) {
  */
 static void write_epilogue(block_t *block) {
     dbg_requires(block != NULL);
-    dbg_requires((char *)block == mem_heap_hi() - 7);
+    dbg_requires(block == find_epilogue());
     block->header = pack(0, false, false, true);
 }
 
@@ -476,29 +838,103 @@ static void write_epilogue(block_t *block) {
 
 /******** The remaining content below are helper and debug routines ********/
 
+/*
+ * ---------------------------------------------------------------------------
+ *                              ALLOCATOR POLICY
+ *
+ * The size classes, how hard a class is searched, how far the heap grows
+ * and whether there are miniblocks are given by an mm_policy_t rather than
+ * fixed, so that alternatives can be replayed side by side in one binary.
+ * mm_init() takes the policy selected last and derives class_table from its
+ * class map, which makes find_seg_index() a single load for the sizes below
+ * class_table_limit. The "default" preset is the layout the allocator was
+ * tuned with: a class per power of two from 64 bytes, first fit, and a
+ * tree from 64 KiB.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief The presets of mm_policy_preset(), "default" first */
+static const mm_policy_t policy_presets[] = {
+    {"default", 6, 1, 12, 0, (1 << 12), 0, true},
+    {"fine", 5, 2, 24, 8, (1 << 12), 0, true},
+    {"best", 6, 1, 12, 16, (1 << 12), 0, true},
+    {"fast", 6, 1, 12, 0, (1 << 16), 3, true},
+    {"nomini", 6, 1, 12, 0, (1 << 12), 0, false},
+};
+
+/**
+ * @brief Looks up a policy preset by name
+ * @param[in] name the name of the preset
+ * @return the preset, or NULL if there is none of that name
+ */
+const mm_policy_t *mm_policy_preset(const char *name) {
+    size_t count = sizeof(policy_presets) / sizeof(policy_presets[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(policy_presets[i].name, name) == 0) {
+            return &policy_presets[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Computes the size class of a block under the current policy
+ * @param[in] block_size the size of the block
+ * @return the class, tree_class for every block of that class and up
+ */
+static size_t class_of(size_t block_size) {
+    size_t rest = block_size >> policy.class_shift;
+    size_t exp = 0;
+    if (rest == 0) {
+        return 0;
+    }
+    while (rest >> 1 != 0) {
+        rest = rest >> 1;
+        exp++;
+    }
+    // The bits below the leading one pick the class within its power of two
+    size_t step = (block_size >> (policy.class_shift + exp - class_steps_log)) &
+                  (policy.class_steps - 1);
+    return min(1 + exp * policy.class_steps + step, tree_class);
+}
+
+/**
+ * @brief Makes the policy selected last the current one
+ */
+static void apply_policy(void) {
+    if (policy_next == NULL) {
+        policy_next = &policy_presets[0];
+    }
+    policy = *policy_next;
+    tree_class = policy.num_classes - 1;
+    class_steps_log = 0;
+    while ((1u << class_steps_log) < policy.class_steps) {
+        class_steps_log++;
+    }
+    for (size_t i = 0; i < class_table_limit / dsize; i++) {
+        class_table[i] = (uint8_t)class_of(i * dsize);
+    }
+}
+
 /**
  * @brief find the index given block size
- * The number of non-zero bits after right-shifted by 6 bits for
- *  block_size are used to determine the index of list
+ * Sizes below class_table_limit are looked up, larger ones computed
  * @param[in] size the size of the block
  */
 size_t find_seg_index(size_t block_size) {
-    size_t idx = 0;
-    block_size = block_size >> 6;
-    while (block_size != 0) {
-        block_size = block_size >> 1;
-        idx++;
-    }
-    if (idx < num_lists)
-        return idx;
-    else {
-        // for too large size of block just leave it in the last list
-        return num_lists - 1;
+    if (block_size < class_table_limit) {
+        return class_table[block_size / dsize];
     }
+    return class_of(block_size);
 }
 
 /**
- * @brief find first fit in seglist[index]; return NULL if no fit found
+ * @brief find a fit in seglist[index]; return NULL if no fit found
+ *
+ * The first block that fits is taken, unless the policy has a fit_depth:
+ * then the smallest of it and the next fit_depth blocks that fit is, and
+ * an exact fit ends the search.
+ *
  * @param[in] asize size of the block
  * @param[in] index the list number to be searched for fit blocks
  * @return found or NULL
@@ -506,17 +942,200 @@ size_t find_seg_index(size_t block_size) {
 block_t *find_seg_fit(size_t index, size_t asize) {
     block_t *block_1 = seglist[index];
     block_t *block = block_1;
+    block_t *best = NULL;
+    size_t best_size = SIZE_MAX;
+    unsigned int fits = 0;
     if (block_1 == NULL)
         return NULL;
     while (block) {
-        if (get_size(block) >= asize) {
-            return block;
+        // The next candidate loads while this one is checked
+        block_t *next = get_next(block);
+        prefetch(next);
+        size_t size = get_size(block);
+        if (size >= asize && size < best_size) {
+            best = block;
+            best_size = size;
+        }
+        if (size >= asize && (size == asize || fits++ == policy.fit_depth)) {
+            return best;
+        }
+        if (next == block_1)
+            return best;
+        block = next;
+    }
+    return best; // NULL if no fit found
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                     TREE OF THE LARGEST SIZE CLASS
+ *
+ * Every block of the last class (64 KiB and up by default) would land in
+ * one list, and with thousands of them a linear scan makes each large malloc
+ * O(n). They are kept in a treap instead: a binary search tree ordered by
+ * (size, address) that is also a max-heap on a priority derived by hashing
+ * the block address. The hash makes the shape that of a random BST, so search,
+ * insertion and removal take O(log n) expected time without storing any
+ * balance information. Searching returns the best fit, and among blocks of
+ * equal size the one with the lowest address, which keeps large
+ * allocations packed towards the start of the heap.
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * @brief The heap priority of a block in the tree
+ * @param[in] block a large free block
+ * @return a pseudo-random priority fixed by the block address
+ */
+static uint64_t tree_priority(block_t *block) {
+#ifdef COMPACT_LINKS
+    // The offset, so that a shared heap has the same tree wherever it is
+    // mapped
+    return ((uint64_t)block_to_link(block) / dsize + 1) * 0x9E3779B97F4A7C15u;
+#else
+    return ((uint64_t)(uintptr_t)block >> 4) * 0x9E3779B97F4A7C15u;
+#endif
+}
+
+/**
+ * @brief The order of the tree: by size, then by address
+ * @return true if block a sorts before block b
+ */
+static bool tree_less(block_t *a, block_t *b) {
+    size_t size_a = get_size(a);
+    size_t size_b = get_size(b);
+    return size_a < size_b || (size_a == size_b && a < b);
+}
+
+/**
+ * @brief Finds the first block of the tree that sorts after a key, which
+ * need not be in the tree
+ * @param[in] size the size of the key
+ * @param[in] key the address of the key
+ * @return the block, or NULL if no block sorts after the key
+ */
+static block_t *tree_after(size_t size, block_t *key) {
+    block_t *after = NULL;
+    block_t *node = large_root;
+    while (node != NULL) {
+        size_t node_size = get_size(node);
+        if (node_size > size || (node_size == size && node > key)) {
+            after = node;
+            node = get_left(node);
+        } else {
+            node = get_right(node);
+        }
+    }
+    return after;
+}
+
+/**
+ * @brief Makes `child` take the place of `old` under `parent`
+ * @param[in] parent the parent of `old`, NULL if `old` is the root
+ * @param[in] old the current child
+ * @param[in] child the new child, may be NULL
+ */
+static void tree_replace_child(block_t *parent, block_t *old, block_t *child) {
+    if (parent == NULL) {
+        large_root = child;
+    } else if (get_left(parent) == old) {
+        set_left(parent, child);
+    } else {
+        set_right(parent, child);
+    }
+    if (child != NULL) {
+        set_parent(child, parent);
+    }
+}
+
+/**
+ * @brief Rotates a block above its parent, preserving the search order
+ * @param[in] block a block in the tree that is not the root
+ */
+static void tree_rotate_up(block_t *block) {
+    block_t *parent = get_parent(block);
+    block_t *grand = get_parent(parent);
+    block_t *middle;
+    if (get_left(parent) == block) {
+        middle = get_right(block);
+        set_left(parent, middle);
+        set_right(block, parent);
+    } else {
+        middle = get_left(block);
+        set_right(parent, middle);
+        set_left(block, parent);
+    }
+    if (middle != NULL) {
+        set_parent(middle, parent);
+    }
+    tree_replace_child(grand, parent, block);
+    set_parent(parent, block);
+}
+
+/**
+ * @brief insert a large free block into the tree
+ * @param[in] block to be inserted
+ */
+void tree_insert(block_t *block) {
+    block_t *parent = NULL;
+    block_t *cur = large_root;
+    set_left(block, NULL);
+    set_right(block, NULL);
+    while (cur != NULL) {
+        parent = cur;
+        cur = tree_less(block, cur) ? get_left(cur) : get_right(cur);
+    }
+    set_parent(block, parent);
+    if (parent == NULL) {
+        large_root = block;
+    } else if (tree_less(block, parent)) {
+        set_left(parent, block);
+    } else {
+        set_right(parent, block);
+    }
+    // Restore the heap order on the priorities
+    while (get_parent(block) != NULL &&
+           tree_priority(block) > tree_priority(get_parent(block))) {
+        tree_rotate_up(block);
+    }
+}
+
+/**
+ * @brief remove a large free block from the tree
+ *
+ * The block is rotated down below its higher-priority child until it has at
+ * most one child, and then spliced out.
+ *
+ * @param[in] block to be removed
+ */
+void tree_remove(block_t *block) {
+    while (get_left(block) != NULL && get_right(block) != NULL) {
+        block_t *left = get_left(block);
+        block_t *right = get_right(block);
+        tree_rotate_up(tree_priority(left) > tree_priority(right) ? left
+                                                                   : right);
+    }
+    block_t *child = get_left(block) ? get_left(block) : get_right(block);
+    tree_replace_child(get_parent(block), block, child);
+}
+
+/**
+ * @brief find the best fit in the tree; ties go to the lowest address
+ * @param[in] asize minimal blocksize for free block
+ * @return the smallest block of at least asize bytes, or NULL
+ */
+block_t *find_tree_fit(size_t asize) {
+    block_t *best = NULL;
+    block_t *cur = large_root;
+    while (cur != NULL) {
+        if (get_size(cur) >= asize) {
+            best = cur;
+            cur = get_left(cur);
+        } else {
+            cur = get_right(cur);
         }
-        if (block->next == block_1)
-            return NULL;
-        block = block->next;
     }
-    return NULL; // no fit found
+    return best;
 }
 
 /**
@@ -528,7 +1147,9 @@ block_t *find_seg_fit(size_t index, size_t asize) {
 block_t *find_fit_seg(size_t asize) {
     size_t index = find_seg_index(asize);
     block_t *block = NULL;
-    while (index < num_lists) {
+    while (index < tree_class) {
+        // The head of the next class loads while this one is scanned
+        prefetch(seglist[index + 1]);
         block = find_seg_fit(index, asize);
         if (block != NULL) {
             return block;
@@ -537,7 +1158,7 @@ block_t *find_fit_seg(size_t asize) {
             index++;
         }
     }
-    return NULL; // no fit found
+    return find_tree_fit(asize); // the largest class is a tree
 }
 
 /**
@@ -554,28 +1175,141 @@ miniblock_t *find_fit_mini() {
 }
 
 /**
- * @brief insert block into seglist
+ * @brief insert block into a circular doubly linked free list
  * LIFO policy
+ * @param[in] root the head of the list
+ * @param[in] block to be inserted
+ */
+void insert_list(block_t **root, block_t *block) {
+    // IF the list is empty, make it the first block and pointing to itself
+    if (*root == NULL) {
+        *root = block;
+        set_prev(block, block);
+        set_next(block, block);
+    } else {
+        // Circulated
+        block_t *seg_block = *root;
+        block_t *seg_pre_block = get_prev(seg_block);
+        set_next(block, seg_block);
+        set_prev(block, seg_pre_block);
+        set_prev(seg_block, block);
+        set_next(seg_pre_block, block);
+    }
+}
+
+/**
+ * @brief romove block from a circular doubly linked free list
+ * @param[in] root the head of the list
+ * @param[in] block to be removed
+ */
+void remove_list(block_t **root, block_t *block) {
+    /* ONLY ONE BLOCK IN THE LIST*/
+    if (block == *root && get_next(block) == block) {
+        *root = NULL;
+        set_next(block, NULL);
+        set_prev(block, NULL);
+        /* FIRST IN LIST THAT HAS MORE THAN ONE BLOCKS */
+    } else if (block == *root && get_next(block) != block) {
+        *root = get_next(block);
+        set_prev(get_next(block), get_prev(block));
+        set_next(get_prev(block), get_next(block));
+        set_next(block, NULL);
+        set_prev(block, NULL);
+        /* OTHER PLACE IN THE LIST*/
+    } else {
+        block_t *block_next = get_next(block);
+        block_t *block_pre = get_prev(block);
+        set_prev(block_next, block_pre);
+        set_next(block_pre, block_next);
+        set_next(block, NULL);
+        set_prev(block, NULL);
+    }
+}
+
+/**
+ * @brief insert block into seglist[index] keeping it sorted by address
+ *
+ * The head of the list is its lowest block, so first fit becomes address
+ * ordered first fit. Rather than always walking from the head, the walk
+ * starts at the block inserted last (seg_hint) and goes forwards or backwards
+ * from there. Frees tend to come in runs of nearby addresses, so the walk is
+ * usually a few steps.
+ *
+ * @param[in] index the size class of the block
+ * @param[in] block to be inserted
+ */
+void insert_list_ordered(size_t index, block_t *block) {
+    block_t *head = seglist[index];
+    block_t *hint = seg_hint[index];
+    block_t *cur;
+    seg_hint[index] = block;
+    if (head == NULL) {
+        insert_list(&seglist[index], block);
+        return;
+    }
+    if (hint == NULL) {
+        hint = head;
+    }
+    if (hint < block) {
+        // Everything from head to hint is below block: walk forwards
+        cur = get_next(hint);
+        while (cur != head && cur < block) {
+            cur = get_next(cur);
+        }
+    } else {
+        // Walk backwards from the hint to the first block that has a lower
+        // predecessor
+        cur = hint;
+        while (cur != head && get_prev(cur) > block) {
+            cur = get_prev(cur);
+        }
+    }
+    // Link block in front of cur; a new lowest block becomes the head
+    block_t *pre = get_prev(cur);
+    set_next(block, cur);
+    set_prev(block, pre);
+    set_prev(cur, block);
+    set_next(pre, block);
+    if (block < head) {
+        seglist[index] = block;
+    }
+}
+
+/**
+ * @brief insert block into seglist
+ * LIFO policy, or address order for the classes in addr_order
  * @param[in] block to be inserted
  */
 void insert_block_seg(block_t *block) {
     size_t block_size = get_size(block);
     size_t index = find_seg_index(block_size);
-    // IF the list is empty, make it the first block and pointing to itself
-    if (seglist[index] == NULL) {
-        seglist[index] = block;
-        block->prev = block;
-        block->next = block;
+    if (index == tree_class) {
+        tree_insert(block);
+    } else if (addr_order & (1u << index)) {
+        insert_list_ordered(index, block);
     } else {
-        // Circulated
-        block_t *seg_block = seglist[index];
-        block_t *seg_pre_block = seg_block->prev;
-        block->next = seg_block;
-        block->prev = seg_pre_block;
-        seg_block->prev = block;
-        seg_pre_block->next = block;
+        insert_list(&seglist[index], block);
     }
 }
+
+#ifdef COMPACT_LINKS
+/**
+ * @brief insert miniblock into minilist
+ * LIFO policy; with compact links a miniblock has room for both links
+ * @param[in] mini_block to be inserted
+ */
+void insert_miniblock(miniblock_t *mini_block) {
+    insert_list(&mini_list, mini_block);
+}
+
+/**
+ * @brief remove miniblock from minilist in constant time
+ * @param[in] mini_block to be removeded
+ */
+void remove_miniblock(miniblock_t *mini_block) {
+    remove_list(&mini_list, mini_block);
+}
+#else
 /**
  * @brief insert miniblock into minilist
  * LIFO policy
@@ -586,9 +1320,9 @@ void insert_miniblock(miniblock_t *mini_block) {
     if (mini_list == NULL) {
         mini_list = mini_block;
         // miniblock list ends with NULL
-        mini_block->next = NULL;
+        set_next(mini_block, NULL);
     } else {
-        mini_block->next = mini_list;
+        set_next(mini_block, mini_list);
         mini_list = mini_block;
     }
 }
@@ -600,25 +1334,26 @@ void insert_miniblock(miniblock_t *mini_block) {
 void remove_miniblock(miniblock_t *mini_block) {
     miniblock_t *mini_blockf = mini_list;
     /* FIRST IN MINILIST THAT HAS MORE THAN ONE MINIBLOCKS */
-    if (mini_blockf == mini_block && mini_blockf->next != NULL) {
-        miniblock_t *mini2 = mini_blockf->next;
+    if (mini_blockf == mini_block && get_next(mini_blockf) != NULL) {
+        miniblock_t *mini2 = get_next(mini_blockf);
         mini_list = mini2;
-        mini_block->next = NULL;
+        set_next(mini_block, NULL);
     }
     /* ONLY ONE IN MINILIST */
-    else if (mini_blockf == mini_block && mini_blockf->next == NULL) {
+    else if (mini_blockf == mini_block && get_next(mini_blockf) == NULL) {
         mini_list = NULL;
-        mini_block->next = NULL;
+        set_next(mini_block, NULL);
     }
     /* OTHER PLACE IN THE MINIBLOCK LIST*/
     else {
-        while (mini_blockf->next != mini_block) {
-            mini_blockf = mini_blockf->next;
+        while (get_next(mini_blockf) != mini_block) {
+            mini_blockf = get_next(mini_blockf);
         }
-        mini_blockf->next = mini_block->next;
-        mini_block->next = NULL;
+        set_next(mini_blockf, get_next(mini_block));
+        set_next(mini_block, NULL);
     }
 }
+#endif /* COMPACT_LINKS */
 
 /**
  * @brief romove block from seglist
@@ -629,27 +1364,39 @@ void remove_block(block_t *block) {
     dbg_requires(get_size(block) != 0);
     size_t block_size = get_size(block);
     size_t index = find_seg_index(block_size);
-
-    /* ONLY ONE BLOCK IN SEGREGATAED LIST*/
-    if (block == seglist[index] && block->next == block) {
-        seglist[index] = NULL;
-        block->next = NULL;
-        block->prev = NULL;
-        /* FIRST IN MINILIST THAT HAS MORE THAN ONE BLOCKS */
-    } else if (block == seglist[index] && block->next != block) {
-        seglist[index] = block->next;
-        block->next->prev = block->prev;
-        block->prev->next = block->next;
-        block->next = NULL;
-        block->prev = NULL;
-        /* OTHER PLACE IN THE SEGREGATAED LIST*/
+    if (index == tree_class) {
+        tree_remove(block);
+        return;
+    }
+    if (seg_hint[index] == block) {
+        // Any other block of the list is as good a hint
+        seg_hint[index] = (get_prev(block) != block) ? get_prev(block) : NULL;
+    }
+    remove_list(&seglist[index], block);
+}
+
+/**
+ * @brief insert a free block into the list for its size
+ * Miniblocks go to minilist, every other block to seglist
+ * @param[in] block to be inserted
+ */
+void insert_free(block_t *block) {
+    if (get_size(block) == dsize) {
+        insert_miniblock((miniblock_t *)block);
+    } else {
+        insert_block_seg(block);
+    }
+}
+
+/**
+ * @brief remove a free block from the list for its size
+ * @param[in] block to be removed
+ */
+void remove_free(block_t *block) {
+    if (get_size(block) == dsize) {
+        remove_miniblock((miniblock_t *)block);
     } else {
-        block_t *block_next = block->next;
-        block_t *block_pre = block->prev;
-        block_next->prev = block_pre;
-        block_pre->next = block_next;
-        block->next = NULL;
-        block->prev = NULL;
+        remove_block(block);
     }
 }
 
@@ -672,14 +1419,8 @@ void *coalesce_block(void *block) {
     size_t size_next = 0;
     /* case 1:only previous block is free */
     if (pre_free && !next_free) {
-        /*prevous is miniblick*/
-        if (get_mini(block)) {
-            prev = block - dsize;
-            size_prev = dsize;
-        } else {
-            prev = find_prev(block);
-            size_prev = get_size(prev);
-        }
+        prev = find_prev(block);
+        size_prev = get_size(prev);
         bool mini = get_mini(prev);
         write_block(prev, size_block + size_prev, mini, true, false);
         block = prev;
@@ -698,14 +1439,8 @@ void *coalesce_block(void *block) {
         write_block(next, next_size, false, false, true);
         /* case 3: both previous block ans next block is free */
     } else if (pre_free && next_free) {
-        if (get_mini(block)) {
-            /*previous is miniblock*/
-            prev = block - dsize;
-            size_prev = dsize;
-        } else {
-            prev = find_prev(block);
-            size_prev = get_size(prev);
-        }
+        prev = find_prev(block);
+        size_prev = get_size(prev);
         size_next = get_size(below);
         bool mini = get_mini(prev);
         write_block(prev, size_block + size_prev + size_next, mini, true,
@@ -728,6 +1463,279 @@ void *coalesce_block(void *block) {
     }
     return block;
 }
+#ifdef LIBMM
+/*
+ * ---------------------------------------------------------------------------
+ *                                NUMA ARENAS
+ *
+ * With MM_NUMA set (mm_set_numa()), the heap is split into one arena per
+ * NUMA node. The heap grows in extents that end on huge page boundaries,
+ * and each extent belongs to the arena of the thread that grew it. Its
+ * pages are bound to that arena's node, and numa_extent[] records the arena
+ * of every huge page of the heap. When an extent follows one of another
+ * arena, it starts with a fence: an allocated block that is never freed, so
+ * blocks never coalesce across arenas.
+ *
+ * Each arena has its own free lists. The globals seglist[], seg_hint[],
+ * mini_list and large_root always hold those of arena numa_current; the
+ * others wait in numa_arena[]. Every call into the heap switches to the
+ * arena of the calling thread, so new blocks come from its local node.
+ * Freeing or growing a block switches to the arena that owns it, so
+ * cross-node frees go back to their owner. Only when an arena cannot grow
+ * does malloc() take a block from another arena. The heap lock stays global.
+ *
+ * Machines with fewer nodes than arenas are simulated: threads are spread
+ * over the arenas by thread id, and arenas without a node are not bound, so
+ * the mode also runs on single-node machines.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Most arenas */
+enum { numa_max_arenas = 8 };
+
+/** @brief Huge pages in the largest heap memlib_os.c reserves, which is
+ * aligned to a huge page */
+enum { numa_max_extents = 1 << 15 };
+
+/** @brief The free lists of an arena while another one is current */
+typedef struct {
+    block_t *seglist[num_lists];
+    block_t *seg_hint[num_lists];
+    miniblock_t *mini_list;
+    block_t *large_root;
+} arena_t;
+
+// Arenas for the next mm_init() and the current one (0 or 1: no NUMA)
+static unsigned int numa_arenas_next = 0;
+static unsigned int numa_arenas = 0;
+// NUMA nodes of the machine
+static unsigned int numa_nodes = 1;
+static arena_t numa_arena[numa_max_arenas];
+// The arena whose free lists are in the globals
+static unsigned int numa_current = 0;
+// The arena of the extent at the end of the heap
+static unsigned int numa_last = 0;
+static uint8_t numa_extent[numa_max_extents];
+
+/** @brief Makes `arena` the current arena, swapping its free lists in */
+static void numa_switch(unsigned int arena) {
+    if (arena == numa_current) {
+        return;
+    }
+    arena_t *old = &numa_arena[numa_current];
+    arena_t *new = &numa_arena[arena];
+    for (size_t i = 0; i < tree_class; i++) {
+        old->seglist[i] = seglist[i];
+        old->seg_hint[i] = seg_hint[i];
+        seglist[i] = new->seglist[i];
+        seg_hint[i] = new->seg_hint[i];
+    }
+    old->mini_list = mini_list;
+    old->large_root = large_root;
+    mini_list = new->mini_list;
+    large_root = new->large_root;
+    numa_current = arena;
+}
+
+/** @brief Returns the arena of the calling thread */
+static unsigned int numa_local(void) {
+    unsigned int node;
+    unsigned int thread;
+    if (numa_nodes < numa_arenas) {
+        mem_numa_where(&node, &thread);
+        return thread % numa_arenas;
+    }
+    mem_numa_where(&node, NULL);
+    return node % numa_arenas;
+}
+
+/** @brief Returns the huge page of the heap that holds `p` */
+static size_t numa_extent_index(void *p) {
+    size_t index = (size_t)((char *)p - (char *)mem_heap_lo()) / huge_page_size;
+    dbg_assert(index < numa_max_extents);
+    return index;
+}
+
+/** @brief Makes the arena that owns `block` the current one */
+static void numa_enter(block_t *block) {
+    numa_switch(numa_extent[numa_extent_index(block)]);
+}
+
+/**
+ * @brief Gives a new extent to the current arena
+ * @param[in] start the old end of the heap
+ * @param[in] size bytes added, up to a huge page boundary
+ */
+static void numa_claim(void *start, size_t size) {
+    size_t first = numa_extent_index(start);
+    size_t end = numa_extent_index((char *)start + size - 1) + 1;
+    for (size_t i = first; i < end; i++) {
+        numa_extent[i] = (uint8_t)numa_current;
+    }
+    if (numa_current < numa_nodes) {
+        mem_numa_bind(start, size, numa_current);
+    }
+    numa_last = numa_current;
+}
+
+/**
+ * @brief Finds a free block of `asize` bytes in any other arena, and makes
+ * that arena the current one
+ * @return the block, or NULL if none fits
+ */
+static block_t *numa_find_fit(size_t asize) {
+    unsigned int local = numa_current;
+    for (unsigned int arena = 0; arena < numa_arenas; arena++) {
+        if (arena == local) {
+            continue;
+        }
+        numa_switch(arena);
+        block_t *block = asize == dsize ? find_fit_mini() : NULL;
+        if (block == NULL) {
+            block = find_fit_seg(asize);
+        }
+        if (block != NULL) {
+            return block;
+        }
+    }
+    numa_switch(local);
+    return NULL;
+}
+#endif /* LIBMM */
+
+/**
+ * @brief Asks the kernel to back the whole huge pages of a new part of the
+ * heap with transparent huge pages
+ *
+ * Free lists and boundary tags are chased all over the heap, and 2 MiB pages
+ * take far fewer TLB entries than 4 KiB ones. Free pages of a heap of huge
+ * pages are not given back under memory pressure, so huge pages are never
+ * split afterwards.
+ *
+ * @param[in] start the old end of the heap
+ * @param[in] size bytes added to the heap
+ */
+static void advise_huge_pages(void *start, size_t size) {
+    uintptr_t lo = round_up((uintptr_t)start, huge_page_size);
+    uintptr_t hi = ((uintptr_t)start + size) & ~(uintptr_t)(huge_page_size - 1);
+    if (lo < hi) {
+        madvise((void *)lo, hi - lo, MADV_HUGEPAGE);
+    }
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                              MEMORY PRESSURE
+ *
+ * mm_set_heap_limit() gives the heap a soft and a hard limit on its size.
+ * extend_heap() never takes the heap past the hard limit, so allocations
+ * fail there as they would when the system is out of memory. Reaching the
+ * soft limit, and every further eighth of it, is a pressure event: the
+ * heap stops growing geometrically, the pages inside its free blocks go
+ * back to the system, and the callbacks registered with
+ * mm_add_pressure_callback() are called so that caches can drop objects.
+ * The pages go back in the driver build too, whose simulated heap is
+ * ordinary memory of the process, so that `replay -L` measures what giving
+ * them back costs. Free blocks are coalesced when they are freed, and the
+ * slack of growing blocks is given back before the heap grows (see REALLOC
+ * GROWTH), so there is nothing left to consolidate. The callbacks run from
+ * heap_unlock(), with the heap lock released so that they can free(); an
+ * allocation refused at the hard limit calls them too.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Number of pressure callbacks that can be registered */
+enum { pressure_slots = 8 };
+
+/** @brief A registered pressure callback and its argument */
+typedef struct {
+    mm_pressure_callback_t fn;
+    void *arg;
+} pressure_entry_t;
+
+static pressure_entry_t pressure_table[pressure_slots];
+static size_t pressure_count = 0;
+// Heap size of the next pressure event
+static size_t pressure_mark = 0;
+// Whether the callbacks are due, and whether they are being called
+static bool pressure_pending = false;
+static bool pressure_calling = false;
+
+/** @brief Bytes at the start of a free block kept for its header and links */
+static const size_t decommit_keep = 8 * sizeof(void *);
+
+/**
+ * @brief Gives the whole pages inside a free block back to the system
+ *
+ * The pages read as zeros when they are next touched, which a free block
+ * does not mind past its links and before its footer.
+ *
+ * @param[in] block a free block
+ */
+static void decommit_block(block_t *block) {
+    uintptr_t page = mem_pagesize();
+    uintptr_t lo = round_up((uintptr_t)block + decommit_keep, page);
+    uintptr_t hi = ((uintptr_t)block + get_size(block) - wsize) & ~(page - 1);
+    if (lo < hi) {
+        madvise((void *)lo, hi - lo, MADV_DONTNEED);
+    }
+}
+
+/**
+ * @brief Decommits every free block of the heap
+ *
+ * An image keeps its pages in its file, and huge pages would be split, so
+ * their free blocks stay as they are.
+ */
+static void decommit_free_blocks(void) {
+    if (image != NULL || huge_pages) {
+        return;
+    }
+    for (block_t *block = heap_start; get_size(block) != 0;
+         block = find_next(block)) {
+        if (!get_alloc(block)) {
+            decommit_block(block);
+        }
+    }
+}
+
+/**
+ * @brief Returns how many bytes the heap may still grow by
+ * @return the room left under the hard limit, SIZE_MAX without one
+ */
+static size_t heap_room(void) {
+    size_t heap_size = mem_heapsize();
+    if (heap_hard_limit == 0) {
+        return SIZE_MAX;
+    }
+    return heap_size < heap_hard_limit ? heap_hard_limit - heap_size : 0;
+}
+
+/**
+ * @brief Tells whether the heap may grow by `size` bytes, and handles the
+ * pressure events of growing it
+ * @param[in] size bytes extend_heap() is about to add
+ * @return false if the heap would pass its hard limit
+ */
+static bool heap_may_grow(size_t size) {
+    size_t heap_size = mem_heapsize();
+    if (size > heap_room()) {
+        pressure_pending = pressure_count != 0;
+        return false;
+    }
+    if (heap_soft_limit != 0 && heap_size + size >= pressure_mark) {
+        pressure_mark = heap_size + size + max(heap_soft_limit >> 3, dsize);
+        pressure_pending = pressure_count != 0;
+        // A maintenance thread walks the heap instead of this allocation
+        if (maint_wanted) {
+            decommit_due = true;
+        } else {
+            decommit_free_blocks();
+        }
+    }
+    return true;
+}
+
 /**
  * @brief Extend the heap and check coalesced blocks
  * @param[in] size the minimal size to be extened
@@ -738,9 +1746,59 @@ void *extend_heap(size_t size, bool mini, bool alloc_pre) {
     void *prev = NULL;
     // Allocate an even number of words to maintain alignment
     size = round_up(size, dsize);
+    bool extents = huge_pages;
+#ifdef LIBMM
+    // A fence keeps the blocks of the new extent from coalescing with those
+    // of the previous one, which belong to another arena
+    bool fence = numa_arenas > 1 && numa_current != numa_last;
+    if (fence) {
+        size += min_block_size;
+    }
+    extents = extents || numa_arenas > 1;
+#endif
+    if (extents) {
+        // Up to a huge page boundary, so that the heap is made of whole
+        // huge pages and the next extension starts a fresh one. Just huge
+        // pages may end short of it under the hard limit, as the next
+        // extension rounds from wherever the heap ends; an arena owns whole
+        // extents, so it may not
+        uintptr_t brk = (uintptr_t)mem_heap_hi() + 1;
+        size_t whole = round_up(brk + size, huge_page_size) - brk;
+        bool arenas = false;
+#ifdef LIBMM
+        arenas = numa_arenas > 1;
+#endif
+        if (arenas || whole <= heap_room()) {
+            size = whole;
+        }
+    }
+#ifdef COMPACT_LINKS
+    if (size > max_heap_size - mem_heapsize()) {
+        return NULL;
+    }
+#endif
+    if (!heap_may_grow(size)) {
+        return NULL;
+    }
     if ((bp = mem_sbrk(size)) == (void *)-1) {
         return NULL;
     }
+    if (huge_pages) {
+        advise_huge_pages(bp, size);
+    }
+#ifdef LIBMM
+    if (numa_arenas > 1) {
+        numa_claim(bp, size);
+        if (fence) {
+            write_block(payload_to_header(bp), min_block_size, mini, alloc_pre,
+                        true);
+            bp = (char *)bp + min_block_size;
+            size -= min_block_size;
+            mini = false;
+            alloc_pre = true;
+        }
+    }
+#endif
 
     // Initialize free block header
     void *block = payload_to_header(bp);
@@ -750,23 +1808,8 @@ void *extend_heap(size_t size, bool mini, bool alloc_pre) {
     write_epilogue(block_next);
     // Coalesce in case the previous block was free
     if (!alloc_pre) {
-        bool mini = get_mini(block);
-        /*ABOVE IS MINIBLOCK*/
-        if (mini) {
-            prev = block - dsize;
-        }
-        /*ABOVE IS NOT MINIBLOCK*/
-        else {
-            prev = find_prev(block);
-        }
-        /*ABOVE IS NOT MINIBLOCK*/
-        if (get_size(prev) > dsize) {
-            remove_block((block_t *)prev);
-        }
-        /*ABOVE IS MINIBLOCK*/
-        else {
-            remove_miniblock((miniblock_t *)prev);
-        }
+        prev = find_prev(block);
+        remove_free(prev);
     }
 
     block = coalesce_block(block);
@@ -830,251 +1873,1545 @@ void split_block(void *block, size_t asize, bool mini, bool alloc_pre) {
         write_block(next, get_size(next), false, true, true);
     }
 }
+/*
+ * ---------------------------------------------------------------------------
+ *                                HARDENING
+ *
+ * With MM_HARDEN_CHECKS, free() and realloc() check that the pointer lies in
+ * the heap and is aligned, that its block is still allocated (a second free
+ * finds the alloc bit clear), and that its size leads to a block whose
+ * header agrees that the previous block is allocated (and whether it is a
+ * miniblock). This costs a few loads per free and no memory.
+ *
+ * MM_HARDEN_CANARY adds an 8-byte canary at the end of every allocated block
+ * but a miniblock: a keyed hash of the block's address, size and alloc bit,
+ * which catches a clobbered header and a write past the end of the payload
+ * at the block's own free(). Miniblocks keep their 8-byte payloads (so small
+ * requests still take the minilist fast path); an overflow out of one hits
+ * the next header and is caught when that block is freed. The canary makes
+ * blocks larger, so it costs utilization, and through the larger heap some
+ * throughput. Failures are reported on stderr and abort().
+ *
+ * A sampled block gets a PROT_NONE guard page right after its payload so an
+ * overflow faults at the offending write. Its canary is flipped with
+ * guard_salt, which is how free() knows to lift the protection again.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Distinguishes the canary of a guarded block */
+static const uint64_t guard_salt = 0x5bd1e9955bd1e995;
+
 /**
- * @brief Checking the heap for :
- * 1. Address alignment for each block
- * 2. Epilogue and prologue blocks
- * 3. Blocks lie within heap boundaries
- * 4. Header and Footer for each block match (size and allocate bit)
- * 5. Block size >= minimum block size
- * 6. Coalescing
- * 7. Free list consistency
+ * @brief Computes the canary of an allocated block
+ *
+ * The bits describing the previous block are left out, since freeing or
+ * allocating the neighbor rewrites them.
  *
- * @param[in] line The line number where mm_checkheap was called
- * @return True if passing mm_checkheap; False if failing
+ * @param[in] block an allocated block
+ * @return a hash of the block's address, size and alloc bit keyed by
+ * canary_secret
  */
-bool mm_checkheap(int line) {
-    return true;
+static uint64_t block_canary(block_t *block) {
+    word_t header = block->header & (size_mask | alloc_mask);
+    uint64_t x = (uint64_t)(uintptr_t)block ^ header ^ canary_secret;
+    x ^= x >> 31;
+    x *= 0x9e3779b97f4a7c15;
+    return x ^ (x >> 29);
 }
-/* For for dubugging and checkpoint */
-// /**
-//  * @brief Checking the heap for :
-//  * 1. Address alignment for each block
-//  * 2. Epilogue and prologue blocks
-//  * 3. Blocks lie within heap boundaries
-//  * 4. Header and Footer for each block match (size and allocate bit)
-//  * 5. Block size >= minimum block size
-//  * 6. Coalescing
-//  * 7. Free list consistency
-//  *
-//  * @param[in] line The line number where mm_checkheap was called
-//  * @return True if passing mm_checkheap; False if failing
-//  */
-// bool mm_checkheap(int line) {
-//     /* block is the first block of the heap (not prologue) */
-//     block_t *block = heap_start;
-//     block_t *pre_block = NULL;
-//     size_t block_size;
-//     bool block_alloc;
-//     // number of free blocks counted by iteration through all the blocks
-//     int num_free_blocks_iter = 0;
-//     // // number of free blocks counted by iteration through free list
-//     int num_free_blocks_list = 0;
-//     // while block is not the epilogue
-//     while ((char *)block != mem_heap_hi() - 7) {
-//         // block size derived from header
-//         block_size = get_size(block);
-//         block_alloc = get_alloc(block);
-//         num_free_blocks_iter += (int)(!block_alloc);
-//         word_t footer = *(header_to_footer(block));
-//         word_t header = *((word_t *)block);
-//         // Check each block address alignment
-//         if (block_size % dsize != 0) {
-//             flag = true;
-//             dbg_printf("[line %d]: Payload size %lu not aligned.\n", line,
-//                        block_size);
-//             return false;
-//         }
-//         // Check if block within heap
-//         if (block < (block_t *)mem_heap_lo() ||
-//             block > (block_t *)mem_heap_hi()) {
-//             flag = true;
-//             dbg_printf("[line %d]: block %p outside area [%p, %p]\n", line,
-//                        block, mem_heap_lo(), mem_heap_hi());
-//             return false;
-//         }
-//         /* Check footer matches header only when for implicit list*/
-//         if (implicit) {
-//             if (footer != header) {
-//                 // Check footersize matches headersize
-//                 if (extract_size(footer) != block_size) {
-//                     flag = true;
-//                     dbg_printf("Footer size %lu missmatches associated header
-//                     "
-//                                "size %lu\n",
-//                                extract_size(footer), block_size);
-//                     return false;
-//                 }
-
-//                 // Check footer allocate matches header allocate
-//                 if (extract_alloc(footer) != block_alloc) {
-//                     flag = true;
-//                     dbg_printf("Footer allocate missmatches associated header
-//                     "
-//                                "allocate %d\n",
-//                                block_alloc);
-//                     return false;
-//                 }
-//             }
-//         }
-//         // Check block size >= minimum block size (not for miniblock)
-//         // if ((block_size < min_block_size)) {
-//         //     flag = true;
-//         //     dbg_printf(
-//         //         "[line %d]: block size %lu less than minimum block size
-//         //         %lu.\n", line, block_size, min_block_size);
-//         //     return false;
-//         // }
-
-//         // Check coalescing
-//         if (pre_block) {
-//             if (!(block_alloc || get_alloc(pre_block))) {
-//                 flag = true;
-//                 dbg_printf("[line %d]: consecutive blocks not coalescing.\n",
-//                            line);
-//                 return false;
-//             }
-//         }
-//         pre_block = block;
-//         block = find_next(block);
-//     }
 
-//     /* Check for epilogue and prologue blocks */
-//     block_t *epilogue = (block_t *)((char *)mem_heap_hi() - 7);
-//     if (get_size(epilogue) != 0) {
-//         flag = true;
-//         dbg_printf("[line %d]: Size of epilogue %lu is not zero.\n", line,
-//                    get_size(epilogue));
-//         return false;
-//     }
-//     if (!get_alloc(epilogue)) {
-//         flag = true;
-//         dbg_printf("[line %d]: Epilogue is not allocated.\n", line);
-//         return false;
-//     }
+/**
+ * @brief Finds the canary slot, the last 8 bytes of the block
+ * @param[in] block an allocated block
+ * @return the address of the canary
+ */
+static char *canary_slot(block_t *block) {
+    return (char *)block + get_size(block) - sizeof(uint64_t);
+}
 
-//     block_t *prologue = (block_t *)((char *)heap_start - wsize);
-//     if (get_size(prologue) != 0) {
-//         flag = true;
-//         dbg_printf("[line %d]: Size of prologue %lu is not zero.\n", line,
-//                    get_size(prologue));
-//         return false;
-//     }
-//     if (!get_alloc(prologue)) {
-//         flag = true;
-//         dbg_printf("[line %d]: Prologue is not allocated.\n", line);
-//         return false;
-//     }
+/**
+ * @brief Writes the canary of an allocated block, which must be redone
+ * whenever its size changes
+ * @param[in] block an allocated block
+ * @param[in] guarded whether the block has a guard page
+ */
+static void seal_block(block_t *block, bool guarded) {
+    uint64_t canary = block_canary(block) ^ (guarded ? guard_salt : 0);
+    __builtin_memcpy(canary_slot(block), &canary, sizeof(canary));
+}
 
-//     /* Check blocks lie within heap boundaries. */
-//     if (prologue < (block_t *)mem_heap_lo()) {
-//         flag = true;
-//         dbg_printf(
-//             "[line %d]: Prologue is outside the heap lower boundary %p.\n",
-//             line, mem_heap_lo());
-//         return false;
-//     }
+/**
+ * @brief Finds the guard page of a guarded block
+ *
+ * The payload ends on a page boundary and the guard page follows it; the
+ * canary is in the page after that.
+ *
+ * @param[in] block a guarded block
+ * @return the start of its guard page
+ */
+static char *guard_page(block_t *block) {
+    size_t page = mem_pagesize();
+    return (char *)(round_up((uintptr_t)canary_slot(block) + 1, page) -
+                    2 * page);
+}
 
-//     /* Check seglist */
-
-//     for (size_t index = 0; index < num_lists; index++) {
-//         if (seglist[index] != NULL) {
-//             num_free_blocks_list++;
-//             block_t *block = seglist[index];
-//             while (block->next) {
-//                 block_t *block_n = block->next;
-//                 num_free_blocks_list++;
-//                 if (block_n->prev != block) {
-//                     printf("seglist pointer is not consistent\n");
-//                     return false;
-//                 }
-//             }
-//         }
-//     }
-//     // number of free blocks matches free list
-//     if (num_free_blocks_iter != num_free_blocks_list) {
-//         printf("free count not equal\n");
-//         return false;
-//     }
-//     return true;
-// }
+/**
+ * @brief Makes the guard pages the previous heap left behind accessible
+ *
+ * A driver that resets the heap with mem_reset_brk() reuses its memory, and
+ * the guard pages of blocks that were never freed would fault there. A heap
+ * that is not the one they were set on may have been released, so its pages
+ * are left alone.
+ */
+static void guard_reset(void) {
+    if (guard_hi != NULL && guard_base == mem_heap_lo()) {
+        mprotect(guard_lo, (size_t)(guard_hi - guard_lo),
+                 PROT_READ | PROT_WRITE);
+    }
+    guard_base = guard_lo = guard_hi = NULL;
+}
 
 /**
- * @brief Initialize the heap and extend it by `chunksize` bytes
- * Iniitialize heap_start and free_start to the newly block generated from
- * extend_heap
- * @return ture if initialization succeeds else false
+ * @brief Reports heap corruption or misuse and aborts
+ * @param[in] op the function that detected it
+ * @param[in] what what is wrong
+ * @param[in] bp the pointer passed to `op`
  */
-bool mm_init(void) {
-    /* initialize segregated list */
-    for (size_t i = 0; i < num_lists; i++) {
-        seglist[i] = NULL;
+static void harden_fail(const char *op, const char *what, void *bp) {
+    fprintf(stderr, "mm: %s(%p): %s\n", op, bp, what);
+    abort();
+}
+
+/**
+ * @brief Checks a pointer passed to free() or realloc()
+ * @param[in] bp the pointer
+ * @param[in] op the function it was passed to, for the report
+ * @return true if the block is guarded
+ */
+static bool check_block(void *bp, const char *op) {
+    char *lo = (char *)heap_start + wsize;
+    char *hi = (char *)mem_heap_hi() + 1;
+    if ((char *)bp < lo || (char *)bp >= hi || (uintptr_t)bp % dsize != 0) {
+        harden_fail(op, "pointer not allocated by mm", bp);
     }
-    /* Initialize minilist */
-    mini_list = NULL;
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+    block_t *block = payload_to_header(bp);
+    if (!get_alloc(block)) {
+        harden_fail(op, "double free", bp);
+    }
+    size_t size = get_size(block);
+    if (size < dsize || size > (size_t)(hi - (char *)block) - wsize) {
+        harden_fail(op, "corrupted block header", bp);
+    }
+    block_t *next = find_next(block);
+    if (!get_alloc_pre(next) || get_mini(next) != (size == dsize)) {
+        harden_fail(op, "corrupted block header", bp);
+    }
+    if (canary_size == 0 || size == dsize) {
+        return false;
+    }
+    uint64_t canary;
+    __builtin_memcpy(&canary, canary_slot(block), sizeof(canary));
+    canary ^= block_canary(block);
+    if (canary != 0 && canary != guard_salt) {
+        harden_fail(op, "corrupted block (overflow or bad header)", bp);
+    }
+    return canary == guard_salt;
+}
 
-    if (start == (void *)-1) {
+/**
+ * @brief Tells whether an allocated block has a guard page
+ * @param[in] block an allocated block
+ */
+static bool is_guarded(block_t *block) {
+    if (canary_size == 0 || get_size(block) == dsize) {
         return false;
     }
+    uint64_t canary;
+    __builtin_memcpy(&canary, canary_slot(block), sizeof(canary));
+    return (canary ^ block_canary(block)) == guard_salt;
+}
 
-    start[0] = pack(0, false, true, true); // Heap prologue (block footer)
-    start[1] = pack(0, false, true, true); // Heap epilogue (block header)
+/**
+ * @brief Returns how many payload bytes the caller may use
+ *
+ * That is the payload minus the trailer (canary and allocation site), if
+ * any, and it stops at the guard page of a guarded block.
+ *
+ * @param[in] block an allocated block
+ */
+static size_t get_usable_size(block_t *block) {
+    if (trailer_size == 0 || get_size(block) == dsize) {
+        return get_payload_size(block);
+    }
+    if (is_guarded(block)) {
+        return (size_t)(guard_page(block) - (char *)header_to_payload(block));
+    }
+    return get_payload_size(block) - trailer_size;
+}
 
-    // Heap starts with first "block header", currently the epilogue
-    heap_start = &(start[1]);
+/*
+ * ---------------------------------------------------------------------------
+ *                               HEAP CHECKER
+ *
+ * heap_check() walks the heap from the prologue to the epilogue, then the
+ * free lists and the tree of every arena, and reports the first broken
+ * invariant on stderr:
+ *  - blocks are 16-byte aligned, a miniblock or at least min_block_size,
+ *    and end at the epilogue;
+ *  - the alloc_pre and mini bits of each header describe the block before
+ *    it, the footer of a free block repeats its header, and no two free
+ *    blocks are neighbors;
+ *  - every free block is in the list of its size class, exactly once: the
+ *    lists are circular (the minilist ends with NULL unless COMPACT_LINKS),
+ *    their prev links mirror their next links, and address-ordered classes
+ *    ascend from their head;
+ *  - the tree is in (size, address) order, every child links back to its
+ *    parent, and no block has a higher priority than its parent;
+ *  - every link refers to a free block of the heap and of its arena, and
+ *    with COMPACT_LINKS the heap fits in the 4 GiB its offsets reach.
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * @brief Reports a broken invariant of the heap
+ * @param[in] line the line mm_checkheap() was called from
+ * @param[in] what the invariant
+ * @param[in] block the block that breaks it
+ * @return false
+ */
+static bool check_fail(int line, const char *what, void *block) {
+    fprintf(stderr, "mm_checkheap(%d): %s at %p\n", line, what, block);
+    return false;
+}
 
-    // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize, false, true) == NULL) {
+/**
+ * @brief Tells whether a link refers to a free block of the heap, and of
+ * the current arena
+ * @param[in] block the block the link refers to, not NULL
+ */
+static bool check_link(block_t *block) {
+    if ((char *)block < (char *)heap_start ||
+        (char *)block >= (char *)find_epilogue() ||
+        (uintptr_t)block->payload % dsize != 0 || get_alloc(block)) {
+        return false;
+    }
+#ifdef LIBMM
+    if (numa_arenas > 1 && numa_extent[numa_extent_index(block)] !=
+                               numa_current) {
         return false;
     }
+#endif
     return true;
 }
 
 /**
- * @brief split the block into asize allocated block and free block
- *
- * @param[in] block block to be split
- * @param[in] asize size of allocated split block
+ * @brief Checks a circular free list
+ * @param[in] line the line mm_checkheap() was called from
+ * @param[in] head the head of the list, or NULL
+ * @param[in] index its size class, num_lists for the minilist
+ * @param[in] limit the free blocks of the heap, which no list passes
+ * @param[in,out] count the free blocks found in lists so far
+ * @return false if an invariant is broken
  */
-void split(void *block, size_t asize) {
-    // miniblock
-    if (get_size(block) == dsize) {
-        remove_miniblock((miniblock_t *)block);
-        // not miniblock
-    } else {
-        remove_block((block_t *)block);
+static bool check_list(int line, block_t *head, size_t index, size_t limit,
+                       size_t *count) {
+    bool ordered = index < num_lists && (addr_order & (1u << index));
+    block_t *block = head;
+    while (block != NULL) {
+        size_t size = get_size(block);
+        if (index == num_lists ? size != dsize
+                               : size == dsize ||
+                                     find_seg_index(size) != index) {
+            return check_fail(line, "free block in the wrong list", block);
+        }
+        if (++*count > limit) {
+            return check_fail(line, "free list does not return to its head",
+                              head);
+        }
+        block_t *next = get_next(block);
+        if (next == NULL || !check_link(next) || get_prev(next) != block) {
+            return check_fail(line, "broken free-list link", block);
+        }
+        if (ordered && next != head && next < block) {
+            return check_fail(line, "list out of address order", block);
+        }
+        block = next != head ? next : NULL;
     }
-    bool alloc_pre = get_alloc_pre(block);
-    bool mini = get_mini(block);
-    split_block(block, asize, mini, alloc_pre);
+    return true;
 }
 
 /**
- * @brief allocate space of size `size` from the heap
- * @param[in] size the minimal size to be allocated feom the heap as a free
- * block
- * @return pointer to the paylod
+ * @brief Checks a subtree of the tree of large free blocks
+ * @param[in] line the line mm_checkheap() was called from
+ * @param[in] block the root of the subtree, or NULL
+ * @param[in] parent the block above it, NULL for the root of the tree
+ * @param[in] low the block every block of the subtree sorts after, or NULL
+ * @param[in] high the block every block of the subtree sorts before, or NULL
+ * @param[in] limit the free blocks of the heap, which the tree cannot pass
+ * @param[in,out] count the free blocks found in lists so far
+ * @return false if an invariant is broken
  */
-void *malloc(size_t size) {
-    // dbg_ensures(mm_checkheap(__LINE__));
-    size_t asize; // Adjusted block size
-    void *block = NULL;
-    miniblock_t *mini_block = NULL;
-    void *bp = NULL;
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        mm_init();
+static bool check_tree(int line, block_t *block, block_t *parent,
+                       block_t *low, block_t *high, size_t limit,
+                       size_t *count) {
+    if (block == NULL) {
+        return true;
     }
-    // Ignore spurious request
-    if (size == 0) {
+    if (!check_link(block) || get_parent(block) != parent) {
+        return check_fail(line, "broken tree link", block);
+    }
+    if (find_seg_index(get_size(block)) != tree_class) {
+        return check_fail(line, "free block in the wrong list", block);
+    }
+    if ((low != NULL && !tree_less(low, block)) ||
+        (high != NULL && !tree_less(block, high))) {
+        return check_fail(line, "tree out of (size, address) order", block);
+    }
+    if (parent != NULL && tree_priority(block) > tree_priority(parent)) {
+        return check_fail(line, "tree out of priority order", block);
+    }
+    if (++*count > limit) {
+        return check_fail(line, "tree has a cycle", block);
+    }
+    return check_tree(line, get_left(block), block, low, block, limit,
+                      count) &&
+           check_tree(line, get_right(block), block, block, high, limit,
+                      count);
+}
+
+/**
+ * @brief Checks the free lists and the tree of the current arena
+ * @param[in] line the line mm_checkheap() was called from
+ * @param[in] limit the free blocks of the heap
+ * @param[in,out] count the free blocks found in lists so far
+ * @return false if an invariant is broken
+ */
+static bool check_arena(int line, size_t limit, size_t *count) {
+    for (size_t i = 0; i < tree_class; i++) {
+        if (seglist[i] != NULL && !check_link(seglist[i])) {
+            return check_fail(line, "broken free-list head", seglist[i]);
+        }
+        if (!check_list(line, seglist[i], i, limit, count)) {
+            return false;
+        }
+    }
+    if (mini_list != NULL && !check_link(mini_list)) {
+        return check_fail(line, "broken free-list head", mini_list);
+    }
+#ifdef COMPACT_LINKS
+    if (!check_list(line, mini_list, num_lists, limit, count)) {
+        return false;
+    }
+#else
+    for (block_t *block = mini_list; block != NULL; block = get_next(block)) {
+        if (get_size(block) != dsize) {
+            return check_fail(line, "free block in the wrong list", block);
+        }
+        if (++*count > limit) {
+            return check_fail(line, "minilist has a cycle", mini_list);
+        }
+        if (get_next(block) != NULL && !check_link(get_next(block))) {
+            return check_fail(line, "broken free-list link", block);
+        }
+    }
+#endif
+    return check_tree(line, large_root, NULL, NULL, NULL, limit, count);
+}
+
+/**
+ * @brief Checks the invariants of the heap (see HEAP CHECKER)
+ * @param[in] line the line mm_checkheap() was called from
+ * @return false, after a report on stderr, if one is broken
+ */
+static bool heap_check(int line) {
+    if (heap_start == NULL) {
+        return true;
+    }
+    block_t *epilogue = find_epilogue();
+    word_t prologue = *find_prev_footer(heap_start);
+    if (extract_size(prologue) != 0 || !extract_alloc(prologue)) {
+        return check_fail(line, "bad prologue", heap_start);
+    }
+    if (get_size(epilogue) != 0 || !get_alloc(epilogue)) {
+        return check_fail(line, "bad epilogue", epilogue);
+    }
+#ifdef COMPACT_LINKS
+    if ((char *)heap_start < link_base ||
+        (size_t)((char *)epilogue - link_base) >= max_heap_size) {
+        return check_fail(line, "heap out of reach of compact links",
+                          epilogue);
+    }
+#endif
+    size_t free_blocks = 0;
+    bool alloc_pre = true;
+    bool mini = false;
+    block_t *block = heap_start;
+    while (block < epilogue) {
+        size_t size = get_size(block);
+        if ((uintptr_t)block->payload % dsize != 0 || size < dsize ||
+            size % dsize != 0 || size > (size_t)((char *)epilogue -
+                                                 (char *)block)) {
+            return check_fail(line, "bad block size or alignment", block);
+        }
+        if (get_alloc_pre(block) != alloc_pre || get_mini(block) != mini) {
+            return check_fail(line, "header disagrees with previous block",
+                              block);
+        }
+        if (!get_alloc(block)) {
+            if (!alloc_pre) {
+                return check_fail(line, "free blocks not coalesced", block);
+            }
+            if (size != dsize && *header_to_footer(block) != block->header) {
+                return check_fail(line, "footer does not match header",
+                                  block);
+            }
+            free_blocks++;
+        }
+        alloc_pre = get_alloc(block);
+        mini = size == dsize;
+        block = find_next(block);
+    }
+    if (block != epilogue || get_alloc_pre(epilogue) != alloc_pre ||
+        get_mini(epilogue) != mini) {
+        return check_fail(line, "last block disagrees with epilogue", block);
+    }
+    size_t listed = 0;
+    bool ok = true;
+#ifdef LIBMM
+    if (numa_arenas > 1) {
+        // Every arena in turn, then the current one again
+        unsigned int current = numa_current;
+        for (unsigned int arena = 0; arena < numa_arenas && ok; arena++) {
+            numa_switch(arena);
+            ok = check_arena(line, free_blocks, &listed);
+        }
+        numa_switch(current);
+    } else {
+        ok = check_arena(line, free_blocks, &listed);
+    }
+#else
+    ok = check_arena(line, free_blocks, &listed);
+#endif
+    if (ok && listed != free_blocks) {
+        return check_fail(line, "free block missing from the free lists",
+                          heap_start);
+    }
+    return ok;
+}
+
+#ifdef LIBMM
+/*
+ * ---------------------------------------------------------------------------
+ *                                HEAP IMAGES
+ *
+ * With MM_IMAGE=<file> in the environment, the heap lives in that file,
+ * mapped shared at a fixed address (image_base, or MM_IMAGE_BASE), so that
+ * pointers stored in the heap stay valid from one run to the next. An
+ * image_header_t comes first in the heap, ahead of the prologue. Saving the
+ * image copies the free-list roots and the layout settings into it; the next
+ * process to open the file finds them and resumes allocating on the heap as
+ * it was left, loading its pages only as they are touched, instead of
+ * rebuilding everything it held. The program finds its objects again from
+ * the root pointer it stored with mm_set_image_root().
+ *
+ * The image is saved at exit and by mm_save_image(), and is marked invalid
+ * again by the next call into the heap, so that a process that dies (or
+ * execs) after changing the heap leaves a file that will not be resumed.
+ * Only one process at a time may have the file open.
+ *
+ * With MM_SHM=<file> instead (a file in /dev/shm, typically), the heap is
+ * shared by every process that has the file open, each mapping it wherever
+ * it likes. That takes a build with COMPACT_LINKS, whose free-list links
+ * are offsets already; the header keeps the roots as offsets too, with a
+ * process-shared lock. Each process loads the roots when it takes the lock
+ * and stores them back when it releases it, so the rest of mm.c works on
+ * its usual globals. Canaries, guard pages and the quarantine depend on
+ * addresses or per-process state and are not available on a shared heap.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Marks a saved image ("mm-image") */
+static const uint64_t image_magic = 0x6d6d2d696d616765;
+
+/** @brief Marks a shared heap ("mm-share") */
+static const uint64_t shm_magic = 0x6d6d2d7368617265;
+
+/** @brief Fingerprint of the block layout, which an image must match */
+static const uint64_t image_layout =
+    (uint64_t)sizeof(word_t) << 16 | (uint64_t)sizeof(link_t) << 8 | num_lists;
+
+/** @brief Default address of heap images */
+static const uintptr_t image_base = (uintptr_t)1 << 45;
+
+/** @brief Address space reserved for a heap image (bytes) */
+static const size_t image_reserve = (size_t)1 << 36;
+
+/**
+ * @brief Reports a heap image that cannot be used, and aborts
+ */
+static void image_fail(const char *path, const char *what) {
+    fprintf(stderr, "mm: %s: %s\n", path, what);
+    abort();
+}
+
+/** @brief Converts a block to its offset in the image */
+static uint64_t image_offset(void *block) {
+    return block == NULL ? 0 : (uint64_t)((char *)block - (char *)image);
+}
+
+/** @brief Converts an offset in the image back to a block */
+static void *image_block(uint64_t offset) {
+    return offset == 0 ? NULL : (char *)image + offset;
+}
+
+/**
+ * @brief Maps the heap from the file named by MM_IMAGE or MM_SHM, if any
+ *
+ * A file that holds a heap which cannot be used aborts the process rather
+ * than being overwritten: one written by another build, a saved image
+ * mapped at another address, or one that was not saved after its last
+ * change.
+ *
+ * @return true if the file holds a heap to resume, false for a new heap
+ */
+static bool image_open(void) {
+    const char *path = getenv("MM_IMAGE");
+    if (path == NULL) {
+        path = getenv("MM_SHM");
+        if (path == NULL) {
+            return false;
+        }
+        image_shared = true;
+    }
+    void *base = NULL;
+    size_t reserve = image_reserve;
+    if (image_shared) {
+#ifdef COMPACT_LINKS
+        reserve = max_heap_size;
+#else
+        image_fail(path, "shared heaps need a build with -DCOMPACT_LINKS");
+#endif
+    } else {
+        const char *base_env = getenv("MM_IMAGE_BASE");
+        base = (void *)(base_env != NULL
+                            ? (uintptr_t)strtoull(base_env, NULL, 0)
+                            : image_base);
+    }
+    if (!mem_init_file(path, base, reserve, image_shared)) {
+        image_fail(path, "cannot be mapped (in use, or its address is taken)");
+    }
+    image = mem_heap_lo();
+    if (mem_heapsize() == 0) {
+        return false;
+    }
+    if (mem_heapsize() < sizeof(image_header_t) ||
+        image->layout != image_layout) {
+        image_fail(path, "is not a heap of this allocator");
+    }
+    if (image_shared) {
+        if (image->magic != shm_magic) {
+            image_fail(path, "is not a shared heap");
+        }
+        return true;
+    }
+    if (image->base != image) {
+        image_fail(path, "is not a heap image for this address");
+    }
+    if (image->magic != image_magic || image->heap_size != mem_heapsize()) {
+        image_fail(path, "was changed after it was last saved");
+    }
+    return true;
+}
+
+/** @brief Takes the free-list roots and the heap size from the header */
+static void image_load_roots(void) {
+    for (size_t i = 0; i < num_lists; i++) {
+        seglist[i] = image_block(image->seglist[i]);
+        seg_hint[i] = image_block(image->seg_hint[i]);
+    }
+    mini_list = image_block(image->mini_list);
+    large_root = image_block(image->large_root);
+    mem_set_heapsize(image->heap_size);
+}
+
+/** @brief Stores the free-list roots and the heap size in the header */
+static void image_store_roots(void) {
+    for (size_t i = 0; i < num_lists; i++) {
+        image->seglist[i] = image_offset(seglist[i]);
+        image->seg_hint[i] = image_offset(seg_hint[i]);
+    }
+    image->mini_list = image_offset(mini_list);
+    image->large_root = image_offset(large_root);
+    image->heap_size = mem_heapsize();
+}
+
+/**
+ * @brief Takes the lock of a shared heap, and the heap as the last process
+ * to hold it left it
+ *
+ * A process that died holding the lock may have left the heap half changed,
+ * so every process aborts from then on.
+ */
+static void image_lock(void) {
+    int err = pthread_mutex_lock(&image->lock);
+    if (err != 0) {
+        if (err == EOWNERDEAD) {
+            pthread_mutex_unlock(&image->lock);
+        }
+        image_fail(getenv("MM_SHM"),
+                   "a process died while changing the shared heap");
+    }
+    image_locked = true;
+    image_load_roots();
+}
+
+/** @brief Publishes the heap to the other processes and unlocks it */
+static void image_unlock(void) {
+    image_store_roots();
+    image_locked = false;
+    pthread_mutex_unlock(&image->lock);
+}
+
+/**
+ * @brief Writes the header of a new shared heap and takes its lock
+ * @return false if the lock cannot be created
+ */
+static bool image_share(void) {
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0) {
+        return false;
+    }
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int err = pthread_mutex_init(&image->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (err != 0) {
+        return false;
+    }
+    image->heap_size = mem_heapsize();
+    image->magic = shm_magic;
+    image_lock();
+    return true;
+}
+
+/**
+ * @brief Takes the settings a heap was created with, which its blocks are
+ * laid out for, from the header
+ */
+static void image_load_settings(void) {
+    policy_custom = image->policy;
+    policy_custom.name = "image";
+    policy_next = &policy_custom;
+    addr_order = image->addr_order;
+    harden_next = image->harden;
+    guard_interval_next = image->guard_interval;
+    quarantine_max_next = image->quarantine_max;
+}
+
+/**
+ * @brief Stores the settings in the header, with the state of the
+ * quarantine, whose ring is in the heap
+ */
+static void image_store_settings(void) {
+    image->policy = policy;
+    image->policy.name = NULL;
+    image->addr_order = addr_order;
+    image->harden = (harden ? MM_HARDEN_CHECKS : 0) |
+                    (canary_size != 0 ? MM_HARDEN_CANARY : 0);
+    image->guard_interval = guard_interval;
+    image->quarantine_max = quarantine_max;
+    image->canary_secret = canary_secret;
+    image->quarantine_ring = quarantine_ring;
+    image->quarantine_cap = quarantine_cap;
+    image->quarantine_head = quarantine_head;
+    image->quarantine_count = quarantine_count;
+    image->quarantine_bytes = quarantine_bytes;
+    image->poison_word = poison_word;
+}
+
+/**
+ * @brief Resumes allocating on the heap found in the file; the settings
+ * were taken by mm_init() already
+ */
+static void image_resume(void) {
+    canary_secret = image->canary_secret;
+    quarantine_ring = image->quarantine_ring;
+    quarantine_cap = image->quarantine_cap;
+    quarantine_head = image->quarantine_head;
+    quarantine_count = image->quarantine_count;
+    quarantine_bytes = image->quarantine_bytes;
+    poison_word = image->poison_word;
+#ifdef COMPACT_LINKS
+    link_base = (char *)image;
+#endif
+    size_t head = round_up(sizeof(image_header_t), dsize);
+    heap_start = (char *)image + head + dsize - wsize;
+    if (image_shared) {
+        mem_file_ready();
+        image_lock();
+    } else {
+        image_load_roots();
+        image->magic = 0;
+    }
+}
+
+/**
+ * @brief Saves the roots and settings in the image header and writes the
+ * heap back to its file
+ * @return false if there is no image or it could not be written
+ */
+static bool image_save(void) {
+    if (image == NULL || image_shared || heap_start == NULL) {
+        return false;
+    }
+    image_store_roots();
+    image_store_settings();
+    image->magic = image_magic;
+    return mem_sync();
+}
+#endif /* LIBMM */
+
+/*
+ * ---------------------------------------------------------------------------
+ *                             BULK COPY AND ZERO
+ *
+ * realloc() copies payloads and calloc() clears them. Those of
+ * stream_min_size bytes and more are written with non-temporal stores,
+ * which bypass the cache: such a payload would otherwise evict the caller's
+ * whole working set, and is rarely read back all at once. On x86-64 this
+ * goes through AVX-512 or AVX2 kernels picked by select_kernels() from what
+ * the CPU supports. Payloads start 16-byte aligned, so the kernels only
+ * need a few 16-byte stores to align the destination for streaming.
+ * Shorter payloads go to memcpy()/memset(), which the C library already
+ * vectorizes as well as a kernel would.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Payloads from this size on bypass the cache (bytes) */
+static const size_t stream_min_size = (size_t)1 << 21;
+
+/** @brief Copies `n` bytes from a 16-byte aligned payload to another */
+typedef void (*copy_kernel_t)(void *dst, const void *src, size_t n);
+
+/** @brief Clears `n` bytes of a 16-byte aligned payload */
+typedef void (*zero_kernel_t)(void *dst, size_t n);
+
+/** @brief memcpy() as a copy kernel */
+static void copy_generic(void *dst, const void *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+/** @brief memset() as a zero kernel */
+static void zero_generic(void *dst, size_t n) {
+    memset(dst, 0, n);
+}
+
+#ifdef __x86_64__
+/** @brief Streams 128 bytes per iteration with AVX2 */
+__attribute__((target("avx2"))) static void copy_avx2(void *dst,
+                                                      const void *src,
+                                                      size_t n) {
+    char *d = dst;
+    const char *s = src;
+    // Streaming stores need 32-byte alignment; d is 16-byte aligned
+    if (((uintptr_t)d & 31) != 0) {
+        _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+        d += 16;
+        s += 16;
+        n -= 16;
+    }
+    for (; n >= 128; n -= 128, d += 128, s += 128) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)s);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i v2 = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i v3 = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_stream_si256((__m256i *)d, v0);
+        _mm256_stream_si256((__m256i *)(d + 32), v1);
+        _mm256_stream_si256((__m256i *)(d + 64), v2);
+        _mm256_stream_si256((__m256i *)(d + 96), v3);
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+}
+
+/** @brief Streams zeros 128 bytes per iteration with AVX2 */
+__attribute__((target("avx2"))) static void zero_avx2(void *dst, size_t n) {
+    char *d = dst;
+    __m256i zero = _mm256_setzero_si256();
+    if (((uintptr_t)d & 31) != 0) {
+        _mm_storeu_si128((__m128i *)d, _mm_setzero_si128());
+        d += 16;
+        n -= 16;
+    }
+    for (; n >= 128; n -= 128, d += 128) {
+        _mm256_stream_si256((__m256i *)d, zero);
+        _mm256_stream_si256((__m256i *)(d + 32), zero);
+        _mm256_stream_si256((__m256i *)(d + 64), zero);
+        _mm256_stream_si256((__m256i *)(d + 96), zero);
+    }
+    _mm_sfence();
+    memset(d, 0, n);
+}
+
+/** @brief Streams 256 bytes per iteration with AVX-512 */
+__attribute__((target("avx512f"))) static void copy_avx512(void *dst,
+                                                           const void *src,
+                                                           size_t n) {
+    char *d = dst;
+    const char *s = src;
+    // Streaming stores need 64-byte alignment; d is 16-byte aligned
+    for (; ((uintptr_t)d & 63) != 0; d += 16, s += 16, n -= 16) {
+        _mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+    }
+    for (; n >= 256; n -= 256, d += 256, s += 256) {
+        __m512i v0 = _mm512_loadu_si512(s);
+        __m512i v1 = _mm512_loadu_si512(s + 64);
+        __m512i v2 = _mm512_loadu_si512(s + 128);
+        __m512i v3 = _mm512_loadu_si512(s + 192);
+        _mm512_stream_si512((__m512i *)d, v0);
+        _mm512_stream_si512((__m512i *)(d + 64), v1);
+        _mm512_stream_si512((__m512i *)(d + 128), v2);
+        _mm512_stream_si512((__m512i *)(d + 192), v3);
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+}
+
+/** @brief Streams zeros 256 bytes per iteration with AVX-512 */
+__attribute__((target("avx512f"))) static void zero_avx512(void *dst,
+                                                           size_t n) {
+    char *d = dst;
+    __m512i zero = _mm512_setzero_si512();
+    for (; ((uintptr_t)d & 63) != 0; d += 16, n -= 16) {
+        _mm_storeu_si128((__m128i *)d, _mm_setzero_si128());
+    }
+    for (; n >= 256; n -= 256, d += 256) {
+        _mm512_stream_si512((__m512i *)d, zero);
+        _mm512_stream_si512((__m512i *)(d + 64), zero);
+        _mm512_stream_si512((__m512i *)(d + 128), zero);
+        _mm512_stream_si512((__m512i *)(d + 192), zero);
+    }
+    _mm_sfence();
+    memset(d, 0, n);
+}
+#endif /* __x86_64__ */
+
+// Kernels for payloads of stream_min_size bytes and more
+static copy_kernel_t copy_kernel = copy_generic;
+static zero_kernel_t zero_kernel = zero_generic;
+
+/**
+ * @brief Picks the widest kernels the CPU supports
+ *
+ * Called by mm_init(), which under LIBMM may run before the constructors
+ * that would otherwise initialize __builtin_cpu_supports().
+ */
+static void select_kernels(void) {
+#ifdef __x86_64__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        copy_kernel = copy_avx512;
+        zero_kernel = zero_avx512;
+        return;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        copy_kernel = copy_avx2;
+        zero_kernel = zero_avx2;
+        return;
+    }
+#endif
+    copy_kernel = copy_generic;
+    zero_kernel = zero_generic;
+}
+
+/**
+ * @brief Copies `n` bytes between two payloads
+ * @param[in] dst start of the destination payload, 16-byte aligned
+ * @param[in] src start of the source payload, 16-byte aligned
+ */
+static void copy_payload(void *dst, const void *src, size_t n) {
+    if (n < stream_min_size) {
+        memcpy(dst, src, n);
+    } else {
+        copy_kernel(dst, src, n);
+    }
+}
+
+/**
+ * @brief Clears the first `n` bytes of a payload
+ * @param[in] dst start of the payload, 16-byte aligned
+ */
+static void zero_payload(void *dst, size_t n) {
+    if (n < stream_min_size) {
+        memset(dst, 0, n);
+    } else {
+        zero_kernel(dst, n);
+    }
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                              REALLOC GROWTH
+ *
+ * A block that realloc() grows is remembered in grow_table, with the number
+ * of bytes the caller asked for. Growing it again is taken as a sign that
+ * it keeps growing (a string or a vector being appended to), so it gets
+ * half as much again as requested: the next appends fit in its slack
+ * without a copy, and since the slack grows with the block, the bytes
+ * copied per byte appended stay bounded. Growth first tries to extend the
+ * block in place (heap_try_expand()) into a free successor, which costs no
+ * copy at all, but never grows the heap for it.
+ *
+ * The slack is not lost: a realloc() below the bytes in use trims the block,
+ * and when malloc() runs out of free blocks the slack of every remembered
+ * block is given back before the heap grows. A maintenance thread also
+ * gives back the slack of blocks that stop growing (see MAINTENANCE).
+ * Asking for the usable size of a block, or growing it with
+ * mm_try_expand(), hands all of it to the caller, so the block is
+ * forgotten, as it is when freed. Blocks carry no mark of their own. With
+ * trailers (hardening, quarantine) or on a shared heap, whose blocks other
+ * processes free, nothing is remembered.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Number of growing blocks remembered */
+enum { grow_slots = 8 };
+
+/** @brief A block grown by realloc() and the bytes of it in use */
+typedef struct {
+    block_t *block;
+    size_t used;
+    /** @brief Not grown since the maintenance thread last looked */
+    bool idle;
+} grow_entry_t;
+
+// Growing blocks, the first grow_count of them valid
+static grow_entry_t grow_table[grow_slots];
+static size_t grow_count = 0;
+// The entry replaced next when the table is full
+static size_t grow_victim = 0;
+// Whether realloc() remembers growing blocks
+static bool grow_tracking = false;
+
+/**
+ * @brief Returns the tail of an allocated block beyond `asize` bytes to the
+ * free lists
+ *
+ * Nothing is done when the tail would be smaller than a miniblock.
+ *
+ * @param[in] block an allocated block
+ * @param[in] asize the block size to keep, a multiple of dsize
+ */
+static void trim_block(block_t *block, size_t asize) {
+    size_t size = get_size(block);
+    dbg_requires(get_alloc(block) && asize >= min_block_size);
+    if (size < asize + dsize) {
+        return;
+    }
+    write_block(block, asize, get_mini(block), get_alloc_pre(block), true);
+    block_t *tail = find_next(block);
+    write_block(tail, size - asize, false, true, false);
+    block_t *below = find_next(tail);
+    if (!get_alloc(below)) {
+        remove_free(below);
+    }
+    tail = coalesce_block(tail);
+    insert_free(tail);
+}
+
+/**
+ * @brief Finds the entry of a block in grow_table
+ * @param[in] block an allocated block
+ * @return the entry, or NULL if the block is not remembered
+ */
+static grow_entry_t *grow_find(block_t *block) {
+    for (size_t i = 0; i < grow_count; i++) {
+        if (grow_table[i].block == block) {
+            return &grow_table[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Remembers a block that realloc() grew
+ * @param[in] block the grown block
+ * @param[in] used the number of bytes requested for it
+ */
+static void grow_remember(block_t *block, size_t used) {
+    grow_entry_t *entry = grow_find(block);
+    if (entry == NULL && grow_count < grow_slots) {
+        entry = &grow_table[grow_count++];
+    } else if (entry == NULL) {
+        entry = &grow_table[grow_victim];
+        grow_victim = (grow_victim + 1) % grow_slots;
+    }
+    entry->block = block;
+    entry->used = used;
+    entry->idle = false;
+}
+
+/**
+ * @brief Forgets a block that is freed or whose slack is the caller's now
+ * @param[in] block an allocated block
+ */
+static void grow_forget(block_t *block) {
+    grow_entry_t *entry = grow_find(block);
+    if (entry != NULL) {
+        *entry = grow_table[--grow_count];
+    }
+}
+
+/**
+ * @brief Gives the slack of every remembered block back to the free lists,
+ * and forgets them
+ * @return true if any slack was given back
+ */
+static bool grow_reclaim(void) {
+    bool reclaimed = false;
+#ifdef LIBMM
+    unsigned int arena = numa_current;
+#endif
+    for (size_t i = 0; i < grow_count; i++) {
+        block_t *block = grow_table[i].block;
+        size_t asize =
+            max(round_up(grow_table[i].used + wsize, dsize), min_block_size);
+        if (get_size(block) < asize + dsize) {
+            continue;
+        }
+#ifdef LIBMM
+        // The slack goes back to the arena of the block
+        if (numa_arenas > 1) {
+            numa_enter(block);
+        }
+#endif
+        trim_block(block, asize);
+        reclaimed = true;
+    }
+#ifdef LIBMM
+    if (numa_arenas > 1) {
+        numa_switch(arena);
+    }
+#endif
+    grow_count = 0;
+    return reclaimed;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                               MAINTENANCE
+ *
+ * With mm_set_maintenance() the heap gets a thread that does in the
+ * background the work that would otherwise land on whichever call happens
+ * to trigger it:
+ *  - the decommit pass of a pressure event (see MEMORY PRESSURE), done on
+ *    the blocks of the tree, which hold nearly all whole free pages, instead
+ *    of by the allocation that met the pressure walking the heap;
+ *  - giving back the slack of blocks that realloc() stopped growing (see
+ *    REALLOC GROWTH), instead of waiting for malloc() to run out;
+ *  - putting the head of each LIFO size class back in address order, so
+ *    that first fit packs blocks as with address-ordered lists without the
+ *    walk of inserting into one.
+ * Coalescing needs no help, as free() coalesces at once.
+ *
+ * Every maint_period the thread takes the heap lock, unless a call holds
+ * it, and works for at most maint_slice before letting it go, so that a
+ * call waits one slice at worst. Between slices it keeps no pointer into
+ * the heap, whose blocks the calls in between may merge: the decommit pass
+ * resumes after the (size, address) key of the last block it visited. The
+ * thread runs at SCHED_IDLE priority, so on a busy CPU it waits for idle
+ * time rather than preempting the program. Outside LIBMM the heap lock is
+ * taken only while the thread runs. mm_init() stops the thread of the
+ * previous heap and the next call into the allocator starts the new one;
+ * heaps with NUMA arenas or images do not get one.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Time between two slices of the maintenance thread (ns) */
+static const long maint_period = 1000000;
+
+/** @brief Longest time the maintenance thread holds the heap lock (ns) */
+static const uint64_t maint_slice = 20000;
+
+/** @brief Most blocks at the head of a list put in order in one go */
+enum { maint_sort_max = 256 };
+
+static pthread_t maint_thread;
+// Set to make the maintenance thread exit
+static bool maint_stop = false;
+// Key of the tree block the decommit pass visited last
+static size_t decommit_size = 0;
+static block_t *decommit_last = NULL;
+// Size class the thread puts in order next
+static size_t maint_class = 0;
+
+/** @brief Reads the monotonic clock (ns) */
+static uint64_t maint_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Gives back the slack of the remembered blocks that did not grow
+ * since the last call, and forgets them
+ */
+static void grow_reclaim_idle(void) {
+#ifdef LIBMM
+    unsigned int arena = numa_current;
+#endif
+    size_t i = 0;
+    while (i < grow_count) {
+        grow_entry_t *entry = &grow_table[i];
+        if (!entry->idle) {
+            // Idle if it has not grown by the next call
+            entry->idle = true;
+            i++;
+            continue;
+        }
+        block_t *block = entry->block;
+        size_t asize =
+            max(round_up(entry->used + wsize, dsize), min_block_size);
+#ifdef LIBMM
+        // The slack goes back to the arena of the block
+        if (numa_arenas > 1) {
+            numa_enter(block);
+        }
+#endif
+        trim_block(block, asize);
+        grow_forget(block);
+    }
+#ifdef LIBMM
+    if (numa_arenas > 1) {
+        numa_switch(arena);
+    }
+#endif
+}
+
+/**
+ * @brief Decommits the next tree block of the pending decommit pass
+ * @return false once the pass is over
+ */
+static bool decommit_step(void) {
+    block_t *block = huge_pages ? NULL : tree_after(decommit_size,
+                                                    decommit_last);
+    if (block == NULL) {
+        decommit_due = false;
+        decommit_size = 0;
+        decommit_last = NULL;
+        return false;
+    }
+    decommit_block(block);
+    decommit_size = get_size(block);
+    decommit_last = block;
+    return true;
+}
+
+/**
+ * @brief Puts up to maint_sort_max blocks at the head of the list of the
+ * next LIFO size class in address order
+ */
+static void sort_step(void) {
+    size_t index = maint_class;
+    maint_class = (maint_class + 1) % tree_class;
+    block_t *head = seglist[index];
+    if ((addr_order & (1u << index)) || head == NULL) {
+        return;
+    }
+    // Leave a head that is in order already
+    size_t count = 1;
+    block_t *block = get_next(head);
+    while (block != head && count < maint_sort_max &&
+           get_prev(block) < block) {
+        block = get_next(block);
+        count++;
+    }
+    if (block == head || count == maint_sort_max) {
+        return;
+    }
+    // Insertion sort, as qsort() may call malloc()
+    block_t *blocks[maint_sort_max];
+    count = 0;
+    while (count < maint_sort_max && seglist[index] != NULL) {
+        block = seglist[index];
+        remove_list(&seglist[index], block);
+        size_t i = count++;
+        for (; i > 0 && blocks[i - 1] > block; i--) {
+            blocks[i] = blocks[i - 1];
+        }
+        blocks[i] = block;
+    }
+    // Append them in order behind the rest and make the first the head
+    for (size_t i = 0; i < count; i++) {
+        insert_list(&seglist[index], blocks[i]);
+    }
+    seglist[index] = blocks[0];
+}
+
+/**
+ * @brief Does one slice of maintenance, with the heap lock held
+ */
+static void maint_work(void) {
+    uint64_t end = maint_clock() + maint_slice;
+    grow_reclaim_idle();
+    while (decommit_due && maint_clock() < end) {
+        decommit_step();
+    }
+    for (size_t i = 0; i < tree_class && maint_clock() < end; i++) {
+        sort_step();
+    }
+}
+
+/**
+ * @brief Body of the maintenance thread
+ * @param[in] arg unused
+ * @return NULL
+ */
+static void *maint_main(void *arg) {
+    (void)arg;
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    struct timespec period = {0, maint_period};
+    while (!__atomic_load_n(&maint_stop, __ATOMIC_ACQUIRE)) {
+        nanosleep(&period, NULL);
+        // A call that holds the lock goes first
+        if (pthread_mutex_trylock(&heap_mutex) != 0) {
+            continue;
+        }
+        if (heap_start != NULL) {
+            maint_work();
+        }
+        pthread_mutex_unlock(&heap_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the maintenance thread, with the heap lock released
+ * @return false if the thread could not be created
+ */
+static bool maint_start(void) {
+    __atomic_store_n(&maint_stop, false, __ATOMIC_RELEASE);
+    return pthread_create(&maint_thread, NULL, maint_main, NULL) == 0;
+}
+
+/**
+ * @brief Stops the maintenance thread, if it runs
+ */
+static void maint_end(void) {
+    if (!maint_running) {
+        return;
+    }
+    __atomic_store_n(&maint_stop, true, __ATOMIC_RELEASE);
+    pthread_join(maint_thread, NULL);
+    maint_running = false;
+}
+
+/**
+ * @brief Initialize the heap and extend it by the chunk size of the policy
+ * Iniitialize heap_start and free_start to the newly block generated from
+ * extend_heap
+ * @return ture if initialization succeeds else false
+ */
+bool mm_init(void) {
+    // The thread of the previous heap must not touch the new one
+    maint_end();
+    guard_reset();
+    /* initialize segregated list */
+    for (size_t i = 0; i < num_lists; i++) {
+        seglist[i] = NULL;
+        seg_hint[i] = NULL;
+    }
+    addr_order = addr_order_next;
+#ifdef LIBMM
+    // Preloaded programs cannot call the mm_set_*() functions, so they set
+    // up the heap through the environment
+    const char *harden_env = getenv("MM_HARDEN");
+    if (harden_env != NULL) {
+        char *end;
+        harden_next = (unsigned int)strtoul(harden_env, &end, 0);
+        guard_interval_next =
+            *end == ',' ? (unsigned int)strtoul(end + 1, NULL, 10) : 0;
+    }
+    const char *quarantine_env = getenv("MM_QUARANTINE");
+    if (quarantine_env != NULL) {
+        quarantine_max_next = strtoul(quarantine_env, NULL, 0);
+    }
+    const char *thp_env = getenv("MM_THP");
+    if (thp_env != NULL) {
+        huge_pages_next = strtoul(thp_env, NULL, 0) != 0;
+    }
+    const char *policy_env = getenv("MM_POLICY");
+    if (policy_env != NULL && mm_policy_preset(policy_env) != NULL) {
+        policy_next = mm_policy_preset(policy_env);
+    }
+    const char *numa_env = getenv("MM_NUMA");
+    if (numa_env != NULL) {
+        numa_arenas_next = (unsigned int)strtoul(numa_env, NULL, 0);
+    }
+    const char *limit_env = getenv("MM_LIMIT");
+    if (limit_env != NULL) {
+        char *end;
+        heap_soft_limit = strtoul(limit_env, &end, 0);
+        heap_hard_limit = *end == ',' ? strtoul(end + 1, NULL, 0) : 0;
+    }
+    const char *maint_env = getenv("MM_MAINT");
+    if (maint_env != NULL) {
+        maint_next = strtoul(maint_env, NULL, 0) != 0;
+    }
+    bool resume = image_open();
+    if (resume) {
+        // The blocks of an image are laid out for its own settings
+        image_load_settings();
+    } else if (image_shared) {
+        harden_next &= MM_HARDEN_CHECKS;
+        quarantine_max_next = 0;
+    }
+#endif
+    apply_policy();
+    harden = harden_next != 0;
+    canary_size = (harden_next & MM_HARDEN_CANARY) ? sizeof(uint64_t) : 0;
+    quarantine_max = quarantine_max_next;
+    site_size = quarantine_max != 0 ? sizeof(void *) : 0;
+    trailer_size = canary_size + site_size;
+    pressure_mark = heap_soft_limit;
+    pressure_pending = false;
+    grow_count = grow_victim = 0;
+    grow_tracking = trailer_size == 0;
+#ifdef LIBMM
+    grow_tracking = grow_tracking && !image_shared;
+#endif
+    quarantine_ring = NULL;
+    quarantine_cap = quarantine_head = quarantine_count = 0;
+    quarantine_bytes = 0;
+    guard_interval = canary_size != 0 ? guard_interval_next : 0;
+    guard_countdown = guard_interval;
+    huge_pages = huge_pages_next;
+    select_kernels();
+#ifdef LIBMM
+    // Images swap their own roots in and out, so they have a single arena
+    numa_nodes = mem_numa_nodes();
+    numa_arenas = image == NULL ? numa_arenas_next : 0;
+    if (numa_arenas == 1) {
+        numa_arenas = numa_nodes;
+    }
+    numa_arenas = (unsigned int)min(numa_arenas, numa_max_arenas);
+    memset(numa_arena, 0, sizeof(numa_arena));
+    numa_current = numa_last = numa_arenas > 1 ? numa_local() : 0;
+#endif
+    maint_wanted = maint_next && image == NULL;
+#ifdef LIBMM
+    maint_wanted = maint_wanted && numa_arenas <= 1;
+#endif
+    decommit_due = false;
+    decommit_size = 0;
+    decommit_last = NULL;
+    maint_class = 0;
+    /* Initialize minilist */
+    mini_list = NULL;
+    large_root = NULL;
+#ifdef LIBMM
+    if (resume) {
+        image_resume();
+        return true;
+    }
+#endif
+    // Create the initial empty heap. The prologue and epilogue take the last
+    // two words of the first dsize bytes, so that payloads are 16-byte
+    // aligned whatever the header size. A heap image keeps its header first
+    size_t head = image != NULL ? round_up(sizeof(image_header_t), dsize) : 0;
+    void *heap_lo = mem_sbrk(head + dsize);
+
+    if (heap_lo == (void *)-1) {
+        return false;
+    }
+
+#ifdef COMPACT_LINKS
+    link_base = heap_lo;
+#endif
+    if (canary_size != 0) {
+        // Not a secret against attackers, just unlikely to be matched by
+        // accident
+        canary_secret = tree_priority(heap_lo) ^ (uintptr_t)&heap_lo;
+    }
+#ifdef LIBMM
+    if (image != NULL) {
+        image->magic = 0;
+        image->layout = image_layout;
+        image->base = image;
+        image->root = 0;
+        image_store_settings();
+        if (image_shared && !image_share()) {
+            return false;
+        }
+    }
+#endif
+    word_t *start = (word_t *)((char *)heap_lo + head + dsize - 2 * wsize);
+    start[0] = pack(0, false, true, true); // Heap prologue (block footer)
+    start[1] = pack(0, false, true, true); // Heap epilogue (block header)
+
+    // Heap starts with first "block header", currently the epilogue
+    heap_start = &(start[1]);
+
+    // Extend the empty heap with a free block of one chunk
+    if (extend_heap(policy.chunk_size, false, true) == NULL) {
+        return false;
+    }
+    if (quarantine_max != 0) {
+        poison_epoch++;
+        poison_word =
+            (tree_priority(heap_lo) + poison_epoch * 0x9E3779B97F4A7C15u) | 1;
+    }
+#ifdef LIBMM
+    if (image_shared) {
+        mem_file_ready();
+    }
+#endif
+    return true;
+}
+
+#ifdef LIBMM
+/**
+ * @brief Splits the heap into NUMA arenas, from the next mm_init() on
+ * @param[in] arenas 1 for one per node, more to simulate as many, 0 for none
+ */
+void mm_set_numa(unsigned int arenas) {
+    numa_arenas_next = arenas;
+}
+#endif
+
+/**
+ * @brief Makes the heap grow in whole transparent huge pages, from the next
+ * mm_init() on
+ * @param[in] enable true for huge pages
+ */
+void mm_set_huge_pages(bool enable) {
+    huge_pages_next = enable;
+}
+
+/**
+ * @brief Selects the allocator policy from the next mm_init() on
+ * @param[in] next the policy, copied; NULL for the default
+ * @return false if a field is out of range
+ */
+bool mm_set_policy(const mm_policy_t *next) {
+    if (next == NULL) {
+        policy_next = &policy_presets[0];
+        return true;
+    }
+    if (next->class_shift < 4 || next->class_shift > 20 ||
+        (next->class_steps != 1 && next->class_steps != 2 &&
+         next->class_steps != 4) ||
+        next->num_classes < 2 || next->num_classes > num_lists ||
+        next->chunk_size == 0 || next->growth_shift >= 64) {
+        return false;
+    }
+    // The tree links a block through three links (see get_left()), so its
+    // smallest size, the first of the last class in class_of(), must hold
+    // them between the header and the footer
+    size_t index = next->num_classes - 2;
+    size_t base = (size_t)1 << (next->class_shift + index / next->class_steps);
+    size_t tree_start = base + index % next->class_steps *
+                                   (base / next->class_steps);
+    if (tree_start < 2 * wsize + 3 * sizeof(link_t)) {
+        return false;
+    }
+    policy_custom = *next;
+    policy_next = &policy_custom;
+    return true;
+}
+
+/**
+ * @brief Selects which seglist classes are kept in address order, from the
+ * next mm_init() on
+ * @param[in] classes bit i set keeps seglist[i] in address order
+ */
+void mm_set_addr_order(unsigned int classes) {
+    addr_order_next = classes;
+}
+
+/**
+ * @brief Sets how many bytes of freed blocks are held back from reuse, from
+ * the next mm_init() on
+ * @param[in] bytes the quarantine limit (0: off)
+ */
+void mm_set_quarantine(size_t bytes) {
+    quarantine_max_next = bytes;
+}
+
+/**
+ * @brief Selects the hardening of the heap from the next mm_init() on
+ * @param[in] flags MM_HARDEN_* bits (0: off)
+ * @param[in] interval give one malloc() in `interval` a guard page (0: none;
+ * needs MM_HARDEN_CANARY)
+ */
+void mm_set_hardening(unsigned int flags, unsigned int interval) {
+    harden_next = flags;
+    if (flags & MM_HARDEN_CANARY) {
+        harden_next |= MM_HARDEN_CHECKS;
+    }
+    guard_interval_next = interval;
+}
+
+/**
+ * @brief split the block into asize allocated block and free block
+ *
+ * @param[in] block block to be split
+ * @param[in] asize size of allocated split block
+ */
+void split(void *block, size_t asize) {
+    remove_free(block);
+    bool alloc_pre = get_alloc_pre(block);
+    bool mini = get_mini(block);
+    split_block(block, asize, mini, alloc_pre);
+}
+
+/**
+ * @brief Tells whether a block can hold `size` bytes, i.e. whether the size
+ * of the block, header and trailer included, does not wrap around
+ */
+static bool request_fits(size_t size) {
+    return size <= SIZE_MAX - dsize - wsize - trailer_size;
+}
+
+/**
+ * @brief allocate space of size `size` from the heap
+ * @param[in] size the minimal size to be allocated feom the heap as a free
+ * block
+ * @return pointer to the paylod
+ */
+static void *heap_malloc(size_t size) {
+    // dbg_ensures(heap_check(__LINE__));
+    size_t asize; // Adjusted block size
+    void *block = NULL;
+    miniblock_t *mini_block = NULL;
+    void *bp = NULL;
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+        mm_init();
+    }
+    // Ignore spurious request
+    if (size == 0 || !request_fits(size)) {
+        return bp;
+    }
+#ifdef COMPACT_LINKS
+    // The block would not fit in the capped heap
+    if (size > max_heap_size) {
         return bp;
     }
+#endif
 
     // Adjust block size to include overhead and to meet alignment
     // requirements
     asize = round_up(size + wsize, dsize);
+    // Without miniblocks the smallest requests take a whole block
+    if (asize == dsize && !policy.mini_blocks) {
+        asize = min_block_size;
+    }
+    // Miniblocks have no room for a trailer
+    if (trailer_size != 0 && asize > dsize) {
+        asize = max(round_up(size + wsize + trailer_size, dsize),
+                    min_block_size);
+    }
     if (asize == dsize) {
         mini_block = find_fit_mini();
         if (mini_block != NULL)
@@ -1082,150 +3419,1157 @@ void *malloc(size_t size) {
         // Search the segmented list for a fit
     }
 
-    if (asize > dsize || mini_block == NULL) {
-        block = (void *)find_fit_seg(asize);
+    if (asize > dsize || mini_block == NULL) {
+        block = (void *)find_fit_seg(asize);
+    }
+
+    // Out of free blocks: take back the slack of growing blocks first
+    if (block == NULL && grow_count != 0 && grow_reclaim()) {
+        block = (void *)find_fit_seg(asize);
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        // Always request at least a chunk, and with geometric growth a
+        // share of the heap
+        size_t extendsize = max(asize, policy.chunk_size);
+        // Past the soft limit the heap grows no faster than it must
+        bool pressure =
+            heap_soft_limit != 0 && mem_heapsize() >= heap_soft_limit;
+        if (policy.growth_shift != 0 && !pressure) {
+            extendsize =
+                max(extendsize, mem_heapsize() >> policy.growth_shift);
+        }
+        // Near the hard limit the heap grows by what is left, if that fits
+        extendsize = max(asize, min(extendsize, heap_room()));
+
+        block_t *epilogue = find_epilogue();
+        bool alloc_pre = get_alloc_pre((void *)epilogue);
+        bool mini = get_mini((void *)epilogue);
+        block = extend_heap(extendsize, mini, alloc_pre);
+#ifdef LIBMM
+        // Out of memory for this node: take a block of another one
+        if (block == NULL && numa_arenas > 1) {
+            block = numa_find_fit(asize);
+        }
+#endif
+
+        // extend_heap returns an error
+        if (block == NULL) {
+            return bp;
+        }
+    }
+
+    split(block, asize);
+    if (canary_size != 0 && asize > dsize) {
+        seal_block(block, false);
+    }
+
+    bp = header_to_payload(block);
+    // dbg_ensures(heap_check(__LINE__));
+    return bp;
+}
+/**
+ * @brief Returns an allocated block to the free lists, coalescing it with
+ * its free neighbors
+ * @param[in] block the block to release
+ */
+static void release_block(block_t *block) {
+    void *above = NULL;
+    size_t size = get_size(block);
+    bool alloc_pre = get_alloc_pre(block);
+    bool mini = get_mini(block);
+#ifdef LIBMM
+    if (numa_arenas > 1) {
+        numa_enter(block);
+    }
+#endif
+
+    // Mark the block as free
+    write_block(block, size, mini, alloc_pre, false);
+
+    // Try to coalesce the block with its neighbors
+    if (!alloc_pre) {
+        above = find_prev(block);
+        remove_free(above);
+    }
+
+    void *below = find_next(block);
+
+    if (below != NULL && !get_alloc(below)) {
+        remove_free(below);
+    }
+    block = coalesce_block(block);
+
+    insert_free(block);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                               QUARANTINE
+ *
+ * With a quarantine, free() does not return a block to the free lists
+ * right away. The block stays marked allocated, so none of its neighbors
+ * coalesce with it and free() itself stays cheap. Its payload is poisoned
+ * and it joins a FIFO ring. Once the ring holds more than quarantine_max
+ * bytes (or is full), the oldest block is checked: any word that lost its
+ * poison was written after the block was freed, and that is reported with
+ * the block's allocation site. The block is then released into the free
+ * lists like any other free().
+ *
+ * The allocation site is the return address of the malloc() (or realloc(),
+ * calloc(), ...) call. It is kept in the block trailer, right before the
+ * canary if there is one; miniblocks have no room for it.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Most payload bytes poisoned and checked per block */
+static const size_t poison_limit = 1 << 10;
+
+/**
+ * @brief Returns how many payload words of a freed block are poisoned
+ * @param[in] block a block in the quarantine
+ */
+static size_t poison_words(block_t *block) {
+    return min(get_usable_size(block), poison_limit) / sizeof(uint64_t);
+}
+
+/**
+ * @brief Finds the allocation-site slot of an allocated block
+ * @param[in] block an allocated block that is not a miniblock
+ * @return the address of the slot
+ */
+static char *site_slot(block_t *block) {
+    return (char *)block + get_size(block) - canary_size - sizeof(void *);
+}
+
+/**
+ * @brief Returns where a block was allocated
+ * @param[in] block an allocated block
+ * @return the return address of the allocating call, or NULL if unknown
+ */
+static void *get_site(block_t *block) {
+    void *site = NULL;
+    if (site_size != 0 && get_size(block) > dsize) {
+        __builtin_memcpy(&site, site_slot(block), sizeof(site));
+    }
+    return site;
+}
+
+/**
+ * @brief Records where a block was allocated, if sites are kept
+ * @param[in] block an allocated block, or NULL
+ * @param[in] site the return address of the allocating call
+ */
+static void set_site(block_t *block, void *site) {
+    if (site_size != 0 && block != NULL && get_size(block) > dsize) {
+        __builtin_memcpy(site_slot(block), &site, sizeof(site));
+    }
+}
+
+/**
+ * @brief Records the allocation site of a payload returned to the caller
+ * @param[in] bp the payload, or NULL
+ * @param[in] site the return address of the allocating call
+ */
+static void record_site(void *bp, void *site) {
+    if (site_size != 0 && bp != NULL) {
+        set_site(payload_to_header(bp), site);
+    }
+}
+
+/**
+ * @brief Tells whether a block is in the quarantine
+ *
+ * Only a block whose payload starts with the poison is looked up in the
+ * ring, as a live block may start with it by chance.
+ *
+ * @param[in] block an allocated block
+ */
+static bool in_quarantine(block_t *block) {
+    uint64_t word;
+    __builtin_memcpy(&word, header_to_payload(block), sizeof(uint64_t));
+    if (word != poison_word) {
+        return false;
+    }
+    for (size_t i = 0; i < quarantine_count; i++) {
+        if (quarantine_ring[(quarantine_head + i) % quarantine_cap] == block) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Releases the oldest block of the quarantine into the free lists,
+ * after checking that it was not written since it was freed
+ */
+static void quarantine_release(void) {
+    block_t *block = quarantine_ring[quarantine_head];
+    quarantine_head = (quarantine_head + 1) % quarantine_cap;
+    quarantine_count--;
+    quarantine_bytes -= get_size(block);
+
+    char *bp = header_to_payload(block);
+    size_t words = poison_words(block);
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        __builtin_memcpy(&word, bp + i * sizeof(uint64_t), sizeof(uint64_t));
+        if (word != poison_word) {
+            fprintf(stderr,
+                    "mm: use after free: %p (%zu bytes, allocated from %p) "
+                    "was written at offset %zu\n",
+                    (void *)bp, get_usable_size(block), get_site(block),
+                    i * sizeof(uint64_t));
+            abort();
+        }
+        // Clear the poison so that no later block starts with it
+        __builtin_memset(bp + i * sizeof(uint64_t), 0, sizeof(uint64_t));
+    }
+    release_block(block);
+}
+
+/**
+ * @brief Poisons a freed block and adds it to the quarantine, releasing the
+ * oldest blocks while the quarantine is over its limits
+ * @param[in] block the block being freed
+ */
+static void quarantine_block(block_t *block) {
+    if (quarantine_ring == NULL) {
+        // One slot per min_block_size bytes of quarantine
+        size_t cap = max(quarantine_max / min_block_size, 1);
+        quarantine_ring = heap_malloc(cap * sizeof(block_t *));
+        if (quarantine_ring == NULL) {
+            release_block(block);
+            return;
+        }
+        quarantine_cap = cap;
+    }
+    char *bp = header_to_payload(block);
+    size_t words = poison_words(block);
+    for (size_t i = 0; i < words; i++) {
+        __builtin_memcpy(bp + i * sizeof(uint64_t), &poison_word,
+                         sizeof(uint64_t));
+    }
+    if (quarantine_count == quarantine_cap) {
+        quarantine_release();
+    }
+    size_t tail = (quarantine_head + quarantine_count) % quarantine_cap;
+    quarantine_ring[tail] = block;
+    quarantine_count++;
+    quarantine_bytes += get_size(block);
+    while (quarantine_bytes > quarantine_max) {
+        quarantine_release();
+    }
+}
+
+/**
+ * @brief free the given allocated block from the heap
+ *
+ * @param[in] bp the pointer to the allocated payload that will be freed in the
+ * heap
+ */
+
+static void heap_free(void *bp) {
+    // dbg_ensures(heap_check(__LINE__));
+    if (bp == NULL) {
+        return;
+    }
+    block_t *block = payload_to_header(bp);
+    if (harden && check_block(bp, "free")) {
+        mprotect(guard_page(block), mem_pagesize(), PROT_READ | PROT_WRITE);
+    }
+    if (grow_count != 0) {
+        grow_forget(block);
+    }
+#ifdef PREFETCH
+    // Coalescing reads the headers of both neighbors; fetch them while the
+    // block is marked free
+    prefetch(find_next(block));
+    if (!get_alloc_pre(block)) {
+        prefetch(find_prev(block));
+    }
+#endif
+    if (quarantine_max != 0) {
+        if (in_quarantine(block)) {
+            harden_fail("free", "double free (block is in quarantine)", bp);
+        }
+        quarantine_block(block);
+        return;
+    }
+    release_block(block);
+    // dbg_ensures(heap_check(__LINE__));
+}
+
+/**
+ * @brief Request at least `elements` number of `size` bytes elemetns to a
+ * block from heap aligned to 16-bite boundary and initialize it with 0
+ * @param[in] elements number of elements to be allocated
+ * @param[in] size The number of bytes per element
+ * @return the pointer to the requested block
+ */
+static void *heap_calloc(size_t elements, size_t size) {
+    void *bp;
+    size_t asize = elements * size;
+    if (elements == 0) {
+        return NULL;
+    }
+    if (asize / elements != size) {
+        // Multiplication overflowed
+        return NULL;
+    }
+
+    bp = heap_malloc(asize);
+    if (bp == NULL) {
+        return NULL;
+    }
+
+    // Initialize all bits to 0
+    zero_payload(bp, asize);
+
+    return bp;
+}
+
+/**
+ * @brief Allocates `size` bytes at an address `offset` bytes short of a
+ * multiple of `alignment`
+ *
+ * A block with alignment - dsize bytes of slack is allocated and its payload
+ * moved forward to the first suitable address. The gap in front becomes a
+ * free block (a miniblock if it is dsize bytes), and whatever is left past
+ * the request is trimmed off the end.
+ *
+ * @param[in] alignment a power of two
+ * @param[in] offset a multiple of dsize; 0 aligns the payload itself
+ * @param[in] size number of bytes requested
+ * @return the payload, or NULL if out of memory
+ */
+static void *heap_memalign(size_t alignment, size_t offset, size_t size) {
+    // Like the larger alignments below, size 0 still gets a unique block
+    if (alignment <= dsize) {
+        return heap_malloc(max(size, 1));
+    }
+    if (!request_fits(size) ||
+        size > SIZE_MAX - alignment - min_block_size - trailer_size) {
+        return NULL;
+    }
+    // The aligned block is never a miniblock, which keeps the mini bit of
+    // the block after it valid
+    size_t asize =
+        max(round_up(size + wsize + trailer_size, dsize), min_block_size);
+    char *bp = heap_malloc(asize - wsize - trailer_size + alignment - dsize);
+    if (bp == NULL) {
+        return NULL;
+    }
+    size_t gap =
+        round_up((uintptr_t)bp + offset, alignment) - offset - (uintptr_t)bp;
+    block_t *block = payload_to_header(bp);
+    if (gap > 0) {
+        size_t size_block = get_size(block);
+        // Blocks are only allocated after free neighbors have coalesced
+        dbg_assert(get_alloc_pre(block));
+        write_block(block, gap, get_mini(block), true, false);
+        insert_free(block);
+        block = payload_to_header(bp + gap);
+        write_block(block, size_block - gap, gap == dsize, false, true);
+    }
+    trim_block(block, asize);
+    if (canary_size != 0) {
+        seal_block(block, false);
+    }
+    return header_to_payload(block);
+}
+
+/**
+ * @brief Allocates `size` bytes followed by an inaccessible guard page
+ *
+ * The payload is placed so that it ends on a page boundary (give or take
+ * the rounding of `size` to dsize), the next page is made PROT_NONE, and the
+ * canary goes just past it.
+ *
+ * @param[in] size number of bytes requested
+ * @return the payload, or NULL if out of memory
+ */
+static void *heap_guarded_malloc(size_t size) {
+    size_t page = mem_pagesize();
+    size_t usable = round_up(size, dsize);
+    if (usable > SIZE_MAX / 2) {
+        return NULL;
+    }
+    char *bp = heap_memalign(page, usable % page, usable + page);
+    if (bp == NULL) {
+        return NULL;
+    }
+    block_t *block = payload_to_header(bp);
+    seal_block(block, true);
+    mprotect(bp + usable, page, PROT_NONE);
+    if (guard_hi == NULL || bp + usable < guard_lo) {
+        guard_lo = bp + usable;
+    }
+    if (bp + usable + page > guard_hi) {
+        guard_hi = bp + usable + page;
+    }
+    guard_base = mem_heap_lo();
+    return bp;
+}
+
+/**
+ * @brief Grows an allocated block in place to hold `size` bytes, if the
+ * space after it is free or the block ends the heap
+ *
+ * The block absorbs a free successor, first growing the heap when the
+ * successor (or the block itself) sits at the end of it and `extend` is
+ * set, and gives back what it does not need with trim_block(). Nothing
+ * changes when it fails.
+ *
+ * @param[in] bp the payload of the block
+ * @param[in] size number of bytes the block must hold
+ * @param[in] extend whether the heap may grow to make room
+ * @return true if the block now holds `size` bytes
+ */
+static bool heap_try_expand(void *bp, size_t size, bool extend) {
+    block_t *block = payload_to_header(bp);
+    size_t block_size = get_size(block);
+    if (size <= get_usable_size(block)) {
+        return true;
+    }
+    // A guarded block cannot grow past its guard page
+    if (!request_fits(size) || is_guarded(block)) {
+        return false;
+    }
+    size_t asize = round_up(size + wsize + trailer_size, dsize);
+    void *site = get_site(block);
+#ifdef LIBMM
+    // The block grows within its own arena, and the caller goes on in its
+    // own one afterwards
+    unsigned int arena = numa_current;
+    if (numa_arenas > 1) {
+        numa_enter(block);
+    }
+#endif
+    block_t *next = find_next(block);
+    bool next_free = !get_alloc(next);
+    size_t avail = block_size + (next_free ? get_size(next) : 0);
+    bool fits = avail >= asize;
+    if (!fits && extend) {
+        block_t *end = next_free ? find_next(next) : next;
+        // By a chunk, or what is left under the hard limit if less
+        size_t grow = max(asize - avail, min(policy.chunk_size, heap_room()));
+        fits = get_size(end) == 0 &&
+               extend_heap(grow, get_mini(end), get_alloc_pre(end)) != NULL;
+    }
+    if (fits) {
+        next = find_next(block);
+        remove_free(next);
+        avail = block_size + get_size(next);
+        write_block(block, avail, get_mini(block), get_alloc_pre(block), true);
+        block_t *below = find_next(block);
+        write_block(below, get_size(below), false, true, true);
+        trim_block(block, asize);
+        set_site(block, site);
+        if (canary_size != 0) {
+            seal_block(block, false);
+        }
+    }
+#ifdef LIBMM
+    if (numa_arenas > 1) {
+        numa_switch(arena);
+    }
+#endif
+    return fits;
+}
+
+/**
+ * @brief Reallocate memory of at least `size` bytes with constraints
+ *
+ * The block is resized in place when it can be: shrinking trims it, and
+ * growing uses its slack or the free space after it. Otherwise the payload
+ * moves to a new block, with slack if the block keeps growing (see REALLOC
+ * GROWTH).
+ *
+ * @param[in] ptr pointer to the block that is going to be reallocate with new
+ * `size`
+ * @param[in] size new number of bytes for reallocating the block
+ * @return pointer to the reallocated block
+ */
+static void *heap_realloc(void *ptr, size_t size) {
+    void *newptr;
+    // If size == 0, then free block and return NULL
+    if (size == 0) {
+        heap_free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, then equivalent to malloc
+    if (ptr == NULL) {
+        return heap_malloc(size);
+    }
+    if (harden) {
+        check_block(ptr, "realloc");
+    }
+    block_t *block = payload_to_header(ptr);
+    size_t usable = get_usable_size(block);
+    grow_entry_t *entry = grow_count != 0 ? grow_find(block) : NULL;
+
+    if (size <= usable) {
+        if (entry != NULL && size >= entry->used) {
+            // Growing into the slack
+            entry->used = size;
+            entry->idle = false;
+            return ptr;
+        }
+        // Shrinking gives back the tail, slack included
+        if (entry != NULL) {
+            grow_forget(block);
+        }
+        if (get_size(block) > dsize && !is_guarded(block)) {
+            void *site = get_site(block);
+#ifdef LIBMM
+            // The tail goes back to the arena of the block
+            if (numa_arenas > 1) {
+                numa_enter(block);
+            }
+#endif
+            trim_block(block, max(round_up(size + wsize + trailer_size, dsize),
+                                  min_block_size));
+            set_site(block, site);
+            if (canary_size != 0) {
+                seal_block(block, false);
+            }
+        }
+        return ptr;
     }
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        size_t extendsize = max(asize, chunksize);
+    // A block that grows again is likely to keep growing
+    size_t want = size;
+    if (entry != NULL && size <= SIZE_MAX / 2) {
+        want = size + size / 2;
+    }
+    // Growing the heap in place would pass over the free blocks that can
+    // take the payload, so that is left to heap_malloc()
+    if (heap_try_expand(ptr, want, false) ||
+        (want > size && heap_try_expand(ptr, size, false))) {
+        if (grow_tracking) {
+            grow_remember(block, size);
+        }
+        return ptr;
+    }
 
-        block_t *epilogue = (block_t *)((char *)(mem_heap_hi() - 7));
-        bool alloc_pre = get_alloc_pre((void *)epilogue);
-        bool mini = get_mini((void *)epilogue);
-        block = extend_heap(extendsize, mini, alloc_pre);
+    // Running out of free blocks, malloc() may trim remembered blocks, and
+    // must leave this one whole for the copy
+    if (entry != NULL) {
+        grow_forget(block);
+    }
+    newptr = heap_malloc(want);
+    if (newptr == NULL && want > size) {
+        newptr = heap_malloc(size);
+    }
+    // If malloc fails, the original block is left untouched
+    if (newptr == NULL) {
+        return NULL;
+    }
+    copy_payload(newptr, ptr, usable);
 
-        // extend_heap returns an error
-        if (block == NULL) {
-            return bp;
-        }
+    // Free the old block
+    heap_free(ptr);
+    if (grow_tracking) {
+        grow_remember(payload_to_header(newptr), size);
     }
+    return newptr;
+}
 
-    split(block, asize);
+/*
+ * ---------------------------------------------------------------------------
+ *                              ENTRY POINTS
+ *
+ * The functions called from outside mm.c take the heap lock (under LIBMM)
+ * and do the work in the heap_* functions above, which call each other
+ * directly so the lock is never taken twice.
+ * ---------------------------------------------------------------------------
+ */
 
-    bp = header_to_payload(block);
-    // dbg_ensures(mm_checkheap(__LINE__));
-    return bp;
+#ifndef LIBMM
+// Whether the program holds heap_mutex, which outside LIBMM it takes only
+// while the maintenance thread runs
+static bool heap_mutex_held = false;
+#endif
+
+/** @brief Acquires the heap lock */
+static void heap_lock(void) {
+#ifndef LIBMM
+    if (maint_running) {
+        pthread_mutex_lock(&heap_mutex);
+        heap_mutex_held = true;
+    }
+#else
+    pthread_mutex_lock(&heap_mutex);
+    if (image_shared) {
+        image_lock();
+    } else if (image != NULL && image->magic != 0) {
+        // A saved image no longer matches the heap once the heap changes
+        image->magic = 0;
+    }
+    if (numa_arenas > 1) {
+        numa_switch(numa_local());
+    }
+#endif
 }
+
 /**
- * @brief free the given allocated block from the heap
+ * @brief Releases the heap lock, then calls the pressure callbacks if the
+ * heap met memory pressure (see MEMORY PRESSURE) and starts the maintenance
+ * thread of a new heap (see MAINTENANCE)
  *
- * @param[in] bp the pointer to the allocated payload that will be freed in the
- * heap
+ * The callbacks may call into the allocator. Pressure met while they run,
+ * by them or by other threads, does not call them again.
  */
+static void heap_unlock(void) {
+    bool call = pressure_pending && !pressure_calling;
+    size_t count = 0;
+    size_t heap_size = 0;
+    if (call) {
+        pressure_pending = false;
+        pressure_calling = true;
+        count = pressure_count;
+        heap_size = mem_heapsize();
+    }
+    bool start = maint_wanted && !maint_running;
+    if (start) {
+        maint_running = true;
+    }
+#ifndef LIBMM
+    if (heap_mutex_held) {
+        heap_mutex_held = false;
+        pthread_mutex_unlock(&heap_mutex);
+    }
+#else
+    if (image_locked) {
+        image_unlock();
+    }
+    pthread_mutex_unlock(&heap_mutex);
+#endif
+    if (start && !maint_start()) {
+        heap_lock();
+        maint_running = maint_wanted = false;
+        heap_unlock();
+    }
+    if (!call) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        pressure_table[i].fn(heap_size, pressure_table[i].arg);
+    }
+    heap_lock();
+    pressure_pending = pressure_calling = false;
+    heap_unlock();
+}
 
-void free(void *bp) {
-    // dbg_ensures(mm_checkheap(__LINE__));
-    void *above = NULL;
-    void *block = payload_to_header(bp);
-    size_t size = get_size(block);
-    bool alloc_pre = get_alloc_pre(block);
-    bool mini = get_mini(block);
+/**
+ * @brief Sets the limits on the heap size, effective at once
+ * @param[in] soft heap size at which memory pressure starts, 0 for none
+ * @param[in] hard heap size never passed, 0 for none
+ */
+void mm_set_heap_limit(size_t soft, size_t hard) {
+    heap_lock();
+    heap_soft_limit = soft;
+    heap_hard_limit = hard;
+    pressure_mark = soft;
+    heap_unlock();
+}
 
-    // Mark the block as free
-    write_block(block, size, mini, alloc_pre, false);
+/**
+ * @brief Registers a function to call on memory pressure
+ * @param[in] fn the callback
+ * @param[in] arg passed to it
+ * @return false if pressure_slots callbacks are registered already
+ */
+bool mm_add_pressure_callback(mm_pressure_callback_t fn, void *arg) {
+    heap_lock();
+    bool added = pressure_count < pressure_slots;
+    if (added) {
+        pressure_table[pressure_count].fn = fn;
+        pressure_table[pressure_count].arg = arg;
+        pressure_count++;
+    }
+    heap_unlock();
+    return added;
+}
 
-    // Try to coalesce the block with its neighbors
-    if (!alloc_pre) {
-        if (get_mini(block)) {
-            above = block - dsize;
-            remove_miniblock((miniblock_t *)above);
-        } else {
-            above = find_prev(block);
-            remove_block(above);
-        }
+/**
+ * @brief Gives the heap a maintenance thread from the next mm_init() on,
+ * or stops the one it has
+ * @param[in] enable true for a thread
+ */
+void mm_set_maintenance(bool enable) {
+    heap_lock();
+    maint_next = enable;
+    if (!enable) {
+        // The thread only tries the lock, so it cannot wait for this call
+        maint_wanted = false;
+        maint_end();
     }
+    heap_unlock();
+}
 
-    void *below = find_next(block);
+#ifdef LIBMM
+/**
+ * @brief Takes the heap lock before fork() so the child never inherits it
+ * taken by a thread that does not exist there
+ *
+ * Only the process's own lock: the lock of a shared heap belongs to the
+ * thread that takes it, and other processes keep using the heap anyway.
+ */
+static void heap_fork_prepare(void) {
+    pthread_mutex_lock(&heap_mutex);
+    mem_fork_prepare();
+}
 
-    if (below != NULL) {
-        bool b_alc = get_alloc(below);
-        if (!b_alc && get_size(below) == dsize) {
-            remove_miniblock((miniblock_t *)below);
-        } else if (!b_alc && get_size(below) != dsize) {
-            remove_block(below);
-        }
+/** @brief Releases the heap lock in the parent after fork() */
+static void heap_fork_parent(void) {
+    mem_fork_parent();
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+/**
+ * @brief Releases the heap lock in the child after fork(), which gets its
+ * own copy of a heap image but keeps sharing a shared heap
+ */
+static void heap_fork_child(void) {
+    mem_fork_child();
+    if (!image_shared) {
+        image = NULL;
     }
-    block = coalesce_block(block);
+    // The maintenance thread is not copied; the next call starts another
+    maint_running = false;
+    pthread_mutex_unlock(&heap_mutex);
+}
 
-    if (get_size(block) == dsize) {
-        insert_miniblock((miniblock_t *)block);
+/** @brief Installs the fork() handlers */
+__attribute__((constructor)) static void heap_atfork(void) {
+    pthread_atfork(heap_fork_prepare, heap_fork_parent, heap_fork_child);
+}
+#endif
+
+/**
+ * @brief The common part of malloc() and mm_malloc_at_least()
+ * @param[in] size number of bytes requested
+ * @param[in] site the allocation site to record
+ * @return the payload, or NULL with errno set to ENOMEM
+ */
+static void *malloc_from(size_t size, void *site) {
+#ifdef LIBMM
+    // Callers of the C library treat NULL as out of memory
+    if (size == 0) {
+        size = 1;
+    }
+#endif
+    heap_lock();
+    void *bp;
+    if (guard_interval != 0 && size != 0 && --guard_countdown == 0) {
+        guard_countdown = guard_interval;
+        bp = heap_guarded_malloc(size);
     } else {
-        insert_block_seg((block_t *)block);
+        bp = heap_malloc(size);
+    }
+    record_site(bp, site);
+    heap_unlock();
+    if (bp == NULL && size != 0) {
+        errno = ENOMEM;
     }
-    // dbg_ensures(mm_checkheap(__LINE__));
+    return bp;
 }
 
 /**
- * @brief Reallocate memory of at least `size` bytes with constraints
- * @param[in] ptr pointer to the block that is going to be reallocate with new
- * `size`
- * @param[in] size new number of bytes for reallocating the block
- * @return pointer to the reallocated block
+ * @brief Allocates `size` bytes aligned to dsize
+ * @param[in] size number of bytes requested
+ * @return the payload, or NULL with errno set to ENOMEM
+ */
+void *malloc(size_t size) {
+    return malloc_from(size, __builtin_return_address(0));
+}
+
+/**
+ * @brief Frees a block returned by any of the allocation functions
+ * @param[in] bp the payload, or NULL
+ */
+void free(void *bp) {
+    heap_lock();
+    heap_free(bp);
+    heap_unlock();
+}
+
+/**
+ * @brief Resizes a block, moving it if needed
+ * @param[in] ptr the payload, or NULL
+ * @param[in] size the new size in bytes
+ * @return the new payload, or NULL
  */
 void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
-    size_t copysize;
-    void *newptr;
-    // If size == 0, then free block and return NULL
-    if (size == 0) {
-        free(ptr);
+    heap_lock();
+    void *bp = heap_realloc(ptr, size);
+    record_site(bp, __builtin_return_address(0));
+    heap_unlock();
+    if (bp == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    return bp;
+}
+
+/**
+ * @brief Allocates a zeroed array of `elements` objects of `size` bytes
+ * @return the payload, or NULL
+ */
+void *calloc(size_t elements, size_t size) {
+#ifdef LIBMM
+    if (elements == 0 || size == 0) {
+        elements = size = 1;
+    }
+#endif
+    heap_lock();
+    void *bp = heap_calloc(elements, size);
+    record_site(bp, __builtin_return_address(0));
+    heap_unlock();
+    if (bp == NULL && elements != 0 && size != 0) {
+        errno = ENOMEM;
+    }
+    return bp;
+}
+
+/**
+ * @brief The common part of the aligned allocation functions
+ * @param[in] alignment a power of two
+ * @param[in] size number of bytes requested
+ * @param[in] site the allocation site to record
+ * @return the payload, or NULL with errno set
+ */
+static void *memalign_from(size_t alignment, size_t size, void *site) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
         return NULL;
     }
+    heap_lock();
+    void *bp = heap_memalign(alignment, 0, size);
+    record_site(bp, site);
+    heap_unlock();
+    if (bp == NULL && size != 0) {
+        errno = ENOMEM;
+    }
+    return bp;
+}
 
-    // If ptr is NULL, then equivalent to malloc
-    if (ptr == NULL) {
-        return malloc(size);
+/**
+ * @brief Allocates `size` bytes aligned to `alignment`
+ * @param[in] alignment a power of two
+ * @param[in] size number of bytes requested
+ * @return the payload, or NULL with errno set
+ */
+void *memalign(size_t alignment, size_t size) {
+    return memalign_from(alignment, size, __builtin_return_address(0));
+}
+
+/**
+ * @brief C11 aligned allocation
+ * @param[in] alignment a power of two
+ * @param[in] size number of bytes requested
+ * @return the payload, or NULL
+ */
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign_from(alignment, size, __builtin_return_address(0));
+}
+
+/**
+ * @brief POSIX aligned allocation
+ * @param[out] memptr set to the payload on success
+ * @param[in] alignment a power of two multiple of sizeof(void *)
+ * @param[in] size number of bytes requested
+ * @return 0, EINVAL for a bad alignment or ENOMEM
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
     }
+    heap_lock();
+    void *bp = heap_memalign(alignment, 0, size);
+    record_site(bp, __builtin_return_address(0));
+    heap_unlock();
+    if (bp == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
 
-    // Otherwise, proceed with reallocation
-    newptr = malloc(size);
+/**
+ * @brief Allocates `size` bytes aligned to a page
+ * @return the payload, or NULL
+ */
+void *valloc(size_t size) {
+    return memalign_from(mem_pagesize(), size, __builtin_return_address(0));
+}
 
-    // If malloc fails, the original block is left untouched
-    if (newptr == NULL) {
+/**
+ * @brief Allocates `size` bytes rounded up to whole pages, page aligned
+ * @return the payload, or NULL
+ */
+void *pvalloc(size_t size) {
+    size_t page = mem_pagesize();
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
         return NULL;
     }
+    return memalign_from(page, round_up(max(size, 1), page),
+                         __builtin_return_address(0));
+}
 
-    // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
-    if (size < copysize) {
-        copysize = size;
+/**
+ * @brief Returns how many bytes the caller may use at `ptr`
+ *
+ * This can be more than was asked for: requests are rounded up to dsize
+ * plus the header, so up to dsize - 1 bytes past the request belong to the
+ * caller, and so does the slack realloc() may have given the block.
+ *
+ * @param[in] ptr the payload, or NULL
+ * @return the payload size of the block, 0 for NULL
+ */
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    heap_lock();
+    block_t *block = payload_to_header(ptr);
+    // The caller may use all of the block now, slack included
+    if (grow_count != 0) {
+        grow_forget(block);
     }
-    memcpy(newptr, ptr, copysize);
+    size_t usable = get_usable_size(block);
+    heap_unlock();
+    return usable;
+}
 
-    // Free the old block
-    free(ptr);
-    return newptr;
+/**
+ * @brief The C library name of mm_usable_size()
+ */
+size_t malloc_usable_size(void *ptr) {
+    return mm_usable_size(ptr);
 }
 
 /**
- * @brief Request at least `elements` number of `size` bytes elemetns to a
- * block from heap aligned to 16-bite boundary and initialize it with 0
- * @param[in] elements number of elements to be allocated
- * @param[in] size The number of bytes per element
- * @return the pointer to the requested block
+ * @brief Allocates at least `size` bytes and reports how many were given
+ * @param[in] size number of bytes requested
+ * @param[out] actual set to the usable size of the block (0 on failure)
+ * @return the payload, or NULL with errno set to ENOMEM
  */
-void *calloc(size_t elements, size_t size) {
-    void *bp;
-    size_t asize = elements * size;
-    if (elements == 0) {
-        return NULL;
+void *mm_malloc_at_least(size_t size, size_t *actual) {
+    void *bp = malloc_from(size, __builtin_return_address(0));
+    *actual = mm_usable_size(bp);
+    return bp;
+}
+
+/**
+ * @brief Checks the heap for corruption (see HEAP CHECKER)
+ * @param[in] line the line it is called from, for the report
+ * @return false, after a report on stderr, if the heap is corrupted
+ */
+bool mm_checkheap(int line) {
+    heap_lock();
+    bool ok = heap_check(line);
+    heap_unlock();
+    return ok;
+}
+
+/**
+ * @brief Grows a block in place to hold `size` bytes, never moving it
+ * @param[in] ptr the payload of an allocated block
+ * @param[in] size number of bytes the block must hold
+ * @return true if it now does, false (with the heap unchanged) otherwise
+ */
+bool mm_try_expand(void *ptr, size_t size) {
+    heap_lock();
+    if (grow_count != 0) {
+        grow_forget(payload_to_header(ptr));
     }
-    if (asize / elements != size) {
-        // Multiplication overflowed
+    bool expanded = heap_try_expand(ptr, size, true);
+    heap_unlock();
+    return expanded;
+}
+
+#ifdef LIBMM
+/**
+ * @brief Returns the root pointer stored in the heap image or shared heap
+ * @return the root, or NULL for a new heap or without one
+ */
+void *mm_image_root(void) {
+    heap_lock();
+    void *root = NULL;
+    if (heap_start != NULL || mm_init()) {
+        root = image != NULL ? image_block(image->root) : NULL;
+    }
+    heap_unlock();
+    return root;
+}
+
+/**
+ * @brief Stores the pointer that other processes start from in the heap
+ * image or shared heap
+ * @param[in] root a block of the heap, or NULL
+ */
+void mm_set_image_root(void *root) {
+    heap_lock();
+    if ((heap_start != NULL || mm_init()) && image != NULL) {
+        image->root = image_offset(root);
+    }
+    heap_unlock();
+}
+
+/**
+ * @brief Saves the heap image and writes it back to its file
+ * @return false without an image or if it could not be written
+ */
+bool mm_save_image(void) {
+    heap_lock();
+    bool saved = image_save();
+    heap_unlock();
+    return saved;
+}
+
+/** @brief Saves the heap image when the process exits */
+__attribute__((destructor)) static void image_close(void) {
+    if (image != NULL && !image_shared) {
+        mm_save_image();
+    }
+}
+#endif
+
+/*
+ * ---------------------------------------------------------------------------
+ *                                 REGIONS
+ *
+ * A region hands out objects that are all released together. It takes large
+ * chunks from malloc() (so they come from the seglists or extend_heap() like
+ * any other block) and bump-allocates inside them, so an object costs a
+ * pointer increment and nothing is split, coalesced or freed until
+ * mm_region_destroy() returns every chunk with one free() each.
+ *
+ * Every chunk starts with a dsize-byte chunk header linking it to the chunk
+ * allocated before it. The mm_region_t itself lives in the first chunk.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Default size of the chunks of a region (bytes) */
+static const size_t region_chunksize = (1 << 14);
+
+/** @brief The header at the start of every region chunk */
+typedef struct region_chunk {
+    struct region_chunk *prev;
+    char pad[8];
+} region_chunk_t;
+
+/** @brief The bookkeeping of a region, stored in its first chunk */
+struct mm_region {
+    char *cursor;           // next free byte in the current chunk
+    char *limit;            // end of the current chunk
+    region_chunk_t *chunks; // most recently allocated chunk
+    size_t chunk_size;      // size requested for new chunks
+};
+
+/**
+ * @brief Allocates a new chunk with room for at least `size` bytes
+ * @param[in] size the number of bytes needed after the chunk header
+ * @param[in] prev the chunk to link the new one to
+ * @param[out] limit set to the end of the usable space of the chunk
+ * @return the new chunk, or NULL if malloc fails
+ */
+static region_chunk_t *region_new_chunk(size_t size, region_chunk_t *prev,
+                                        char **limit) {
+    region_chunk_t *chunk = malloc(sizeof(region_chunk_t) + size);
+    if (chunk == NULL) {
         return NULL;
     }
+    chunk->prev = prev;
+    // Use the slack the block actually has, not only what was asked for
+    *limit = (char *)chunk + get_usable_size(payload_to_header(chunk));
+    return chunk;
+}
 
-    bp = malloc(asize);
-    if (bp == NULL) {
+/**
+ * @brief Creates an empty region
+ * @param[in] chunk_size bytes to take from malloc() at a time (0 for the
+ * default)
+ * @return the new region, or NULL if out of memory
+ */
+mm_region_t *mm_region_create(size_t chunk_size) {
+    char *limit;
+    if (chunk_size == 0) {
+        chunk_size = region_chunksize;
+    }
+    chunk_size = round_up(max(chunk_size, sizeof(mm_region_t)), dsize);
+    region_chunk_t *chunk = region_new_chunk(chunk_size, NULL, &limit);
+    if (chunk == NULL) {
         return NULL;
     }
+    mm_region_t *region = (mm_region_t *)(chunk + 1);
+    region->cursor = (char *)region + round_up(sizeof(mm_region_t), dsize);
+    region->limit = limit;
+    region->chunks = chunk;
+    region->chunk_size = chunk_size;
+    return region;
+}
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+/**
+ * @brief Allocates `size` bytes from a region, aligned to dsize
+ *
+ * The fast path bumps the cursor of the current chunk. When the chunk is
+ * full a new one is started; requests larger than a quarter of a chunk get a
+ * chunk of their own so that the rest of the current chunk is not wasted.
+ *
+ * @param[in] region the region to allocate from
+ * @param[in] size number of bytes requested
+ * @return the object, or NULL if out of memory
+ */
+void *mm_region_alloc(mm_region_t *region, size_t size) {
+    char *limit;
+    if (size > SIZE_MAX - 2 * dsize) {
+        return NULL;
+    }
+    size = round_up(size, dsize);
+    if (size <= (size_t)(region->limit - region->cursor)) {
+        void *bp = region->cursor;
+        region->cursor += size;
+        return bp;
+    }
+    if (size > region->chunk_size / 4) {
+        // Link the dedicated chunk behind the current one
+        region_chunk_t *chunk =
+            region_new_chunk(size, region->chunks->prev, &limit);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        region->chunks->prev = chunk;
+        return chunk + 1;
+    }
+    region_chunk_t *chunk =
+        region_new_chunk(region->chunk_size, region->chunks, &limit);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    region->chunks = chunk;
+    region->cursor = (char *)(chunk + 1) + size;
+    region->limit = limit;
+    return chunk + 1;
+}
 
-    return bp;
+/**
+ * @brief Releases every object of a region, and the region itself
+ * @param[in] region the region to destroy
+ */
+void mm_region_destroy(mm_region_t *region) {
+    region_chunk_t *chunk = region->chunks;
+    while (chunk != NULL) {
+        region_chunk_t *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
 }
 
 // /**
@@ -0,0 +1,430 @@
+/**
+ * @file mm_allocator.hpp
+ * @brief Header-only C++ adapters for the mm.c allocator
+ *
+ * - mm::resource: a std::pmr::memory_resource backed by mm.c's malloc/free,
+ *   honouring sized and over-aligned deallocation
+ * - mm::region_resource: a monotonic memory_resource on top of mm_region_t,
+ *   for containers whose elements all die together
+ * - mm::allocator<T>: a plain STL allocator backed by mm.c
+ * - mm::pool_allocator<T>: an STL allocator that serves single objects from
+ *   a fixed-size pool picked at compile time from sizeof(T), so node-based
+ *   containers (list, map, set, ...) get a free-list pop/push per node
+ *   instead of a trip through the general malloc/free
+ *
+ * They are as thread-safe as the malloc() under them, which the library
+ * build (LIBMM) locks: each thread has pools of its own. In the driver
+ * build, call mm::reset_pools() whenever the heap is reset and mm_init()
+ * starts a new one. Requires C++17.
+ *
+ * @author Yi-Jing <ysie@andrew.cmu.edu>
+ */
+
+#ifndef MM_ALLOCATOR_HPP
+#define MM_ALLOCATOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#include "mm_ext.h"
+
+#ifdef DRIVER
+extern "C" {
+#include "mm.h"
+}
+#endif
+
+namespace mm {
+
+/** @brief Payload alignment guaranteed by mm.c (dsize) */
+inline constexpr std::size_t alignment = 16;
+
+/** @brief Largest object served by the fixed-size pools */
+inline constexpr std::size_t max_pooled_size = 256;
+
+namespace detail {
+
+/** @brief Calls mm.c's malloc, whatever name the build gives it */
+inline void *raw_malloc(std::size_t size) {
+#ifdef DRIVER
+    return mm_malloc(size);
+#else
+    return std::malloc(size);
+#endif
+}
+
+/** @brief Calls mm.c's free, whatever name the build gives it */
+inline void raw_free(void *ptr) {
+#ifdef DRIVER
+    mm_free(ptr);
+#else
+    std::free(ptr);
+#endif
+}
+
+/**
+ * @brief Allocates `size` bytes aligned to `align`
+ *
+ * mm.c payloads are already 16-byte aligned. For larger alignments the block
+ * is over-allocated and the original pointer is stored in the word just
+ * before the aligned address.
+ *
+ * @return the memory, or nullptr if out of memory
+ */
+inline void *aligned_malloc(std::size_t size, std::size_t align) {
+    if (align <= alignment) {
+        return raw_malloc(size);
+    }
+    if (size > std::numeric_limits<std::size_t>::max() - align) {
+        return nullptr;
+    }
+    void *raw = raw_malloc(size + align);
+    if (raw == nullptr) {
+        return nullptr;
+    }
+    auto addr = reinterpret_cast<std::uintptr_t>(raw);
+    auto aligned = reinterpret_cast<void **>((addr + align) & ~(align - 1));
+    aligned[-1] = raw;
+    return aligned;
+}
+
+/** @brief Releases memory from aligned_malloc() with the same `align` */
+inline void aligned_free(void *ptr, std::size_t align) {
+    if (align <= alignment) {
+        raw_free(ptr);
+    } else if (ptr != nullptr) {
+        raw_free(static_cast<void **>(ptr)[-1]);
+    }
+}
+
+/** @brief Rounds an object up to its pool size class */
+constexpr std::size_t pool_class(std::size_t size, std::size_t align) {
+    std::size_t unit = align > alignment ? align : alignment;
+    return size == 0 ? unit : (size + unit - 1) / unit * unit;
+}
+
+} // namespace detail
+
+/**
+ * @brief A pool of fixed-size slots for one size class
+ *
+ * Slots are carved from chunks taken with malloc() and recycled through an
+ * intrusive singly linked free list. Chunks are kept for the lifetime of
+ * the program. Each thread has one pool per size class, shared by every
+ * type that rounds up to it, so the free list needs no lock; a slot may be
+ * freed to another thread's pool than it came from. The free slots of a
+ * thread that exits are passed on to the next pool of the class that runs
+ * dry.
+ *
+ * @tparam Size the slot size, a multiple of 16
+ */
+template <std::size_t Size> class fixed_pool {
+    static_assert(Size % alignment == 0 && Size >= sizeof(void *),
+                  "pool slots must be 16-byte multiples");
+
+  public:
+    /** @brief Number of slots taken from malloc() at a time */
+    static constexpr std::size_t slots_per_chunk =
+        Size >= 4096 ? 1 : 4096 / Size;
+
+    /** @brief The calling thread's pool of this size class */
+    static fixed_pool &instance() {
+        static thread_local fixed_pool pool;
+        return pool;
+    }
+
+    fixed_pool(const fixed_pool &) = delete;
+    fixed_pool &operator=(const fixed_pool &) = delete;
+
+    ~fixed_pool() {
+        if (free_ == nullptr) {
+            return;
+        }
+        slot *last = free_;
+        while (last->next != nullptr) {
+            last = last->next;
+        }
+        std::lock_guard<std::mutex> lock(orphans_mutex_);
+        last->next = orphans_;
+        orphans_ = free_;
+    }
+
+    /** @brief Takes a slot, or returns nullptr if out of memory */
+    void *allocate() {
+        if (free_ == nullptr && !refill()) {
+            return nullptr;
+        }
+        slot *s = free_;
+        free_ = s->next;
+        return s;
+    }
+
+    /** @brief Returns a slot to the pool */
+    void deallocate(void *ptr) {
+        slot *s = static_cast<slot *>(ptr);
+        s->next = free_;
+        free_ = s;
+    }
+
+    /** @brief Forgets every free slot, whose chunks a new heap took over */
+    void reset() {
+        free_ = nullptr;
+        std::lock_guard<std::mutex> lock(orphans_mutex_);
+        orphans_ = nullptr;
+    }
+
+  private:
+    struct slot {
+        slot *next;
+    };
+
+    fixed_pool() = default;
+
+    /** @brief Takes the slots of exited threads, or threads a new chunk
+     * onto the free list */
+    bool refill() {
+        {
+            std::lock_guard<std::mutex> lock(orphans_mutex_);
+            if (orphans_ != nullptr) {
+                free_ = orphans_;
+                orphans_ = nullptr;
+                return true;
+            }
+        }
+        char *chunk =
+            static_cast<char *>(detail::raw_malloc(Size * slots_per_chunk));
+        if (chunk == nullptr) {
+            return false;
+        }
+        for (std::size_t i = slots_per_chunk; i-- > 0;) {
+            deallocate(chunk + i * Size);
+        }
+        return true;
+    }
+
+    slot *free_ = nullptr;
+
+    // Free slots left by exited threads
+    static inline std::mutex orphans_mutex_;
+    static inline slot *orphans_ = nullptr;
+};
+
+namespace detail {
+
+/** @brief Resets the calling thread's pool of every pooled size class */
+template <std::size_t... I> void reset_pools(std::index_sequence<I...>) {
+    (fixed_pool<(I + 1) * alignment>::instance().reset(), ...);
+}
+
+} // namespace detail
+
+/**
+ * @brief Forgets the free slots of the pools
+ *
+ * Only needed in the driver build, where mem_reset_brk() and mm_init() start
+ * a new heap over the chunks of the pools: call it after each such reset,
+ * from the thread that uses the pools, once no container holds pooled
+ * objects of the old heap.
+ */
+inline void reset_pools() {
+    constexpr std::size_t classes = max_pooled_size / alignment;
+    detail::reset_pools(std::make_index_sequence<classes>());
+}
+
+/**
+ * @brief A std::pmr::memory_resource backed by mm.c
+ *
+ * Deallocation uses the alignment it is given to find the block again, so
+ * over-aligned requests are supported.
+ */
+class resource : public std::pmr::memory_resource {
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        void *ptr = detail::aligned_malloc(bytes, align);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t align) override {
+        detail::aligned_free(ptr, align);
+    }
+
+    bool do_is_equal(const memory_resource &other) const noexcept override {
+        return dynamic_cast<const resource *>(&other) != nullptr;
+    }
+};
+
+/** @brief The process-wide mm::resource */
+inline resource *default_resource() {
+    static resource res;
+    return &res;
+}
+
+/**
+ * @brief A monotonic std::pmr::memory_resource on top of an mm_region_t
+ *
+ * Deallocation is a no-op; everything is released at once when the resource
+ * is destroyed or release() is called.
+ */
+class region_resource : public std::pmr::memory_resource {
+  public:
+    /** @param[in] chunk_size bytes to take from the heap at a time */
+    explicit region_resource(std::size_t chunk_size = 0)
+        : chunk_size_(chunk_size), region_(nullptr) {}
+
+    region_resource(const region_resource &) = delete;
+    region_resource &operator=(const region_resource &) = delete;
+
+    ~region_resource() override {
+        release();
+    }
+
+    /** @brief Frees everything allocated from this resource */
+    void release() {
+        if (region_ != nullptr) {
+            mm_region_destroy(region_);
+            region_ = nullptr;
+        }
+    }
+
+  protected:
+    void *do_allocate(std::size_t bytes, std::size_t align) override {
+        if (region_ == nullptr) {
+            region_ = mm_region_create(chunk_size_);
+            if (region_ == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+        // Regions hand out 16-byte aligned objects; pad for more
+        std::size_t pad = align > alignment ? align - alignment : 0;
+        if (bytes > std::numeric_limits<std::size_t>::max() - pad) {
+            throw std::bad_alloc();
+        }
+        void *ptr = mm_region_alloc(region_, bytes + pad);
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        auto addr = reinterpret_cast<std::uintptr_t>(ptr);
+        return reinterpret_cast<void *>((addr + align - 1) & ~(align - 1));
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+  private:
+    std::size_t chunk_size_;
+    mm_region_t *region_;
+};
+
+/**
+ * @brief A stateless STL allocator backed by mm.c
+ * @tparam T the element type
+ */
+template <typename T> class allocator {
+  public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+    template <typename U> allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) {
+            throw std::bad_array_new_length();
+        }
+        void *ptr = detail::aligned_malloc(n * sizeof(T), alignof(T));
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept {
+        detail::aligned_free(ptr, alignof(T));
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept {
+    return false;
+}
+
+/**
+ * @brief An STL allocator that serves single objects from a fixed_pool
+ *
+ * The size class is computed at compile time from sizeof(T) and alignof(T).
+ * Single-element requests (the nodes of node-based containers) go to the
+ * pool of that class; arrays and objects above max_pooled_size fall back to
+ * mm.c's malloc. The element count passed to deallocate() tells the two
+ * apart, so no per-object header is needed.
+ *
+ * @tparam T the element type
+ */
+template <typename T> class pool_allocator {
+  public:
+    using value_type = T;
+
+    /** @brief The slot size used for a single T */
+    static constexpr std::size_t slot_size =
+        detail::pool_class(sizeof(T), alignof(T));
+
+    /** @brief Whether single objects of T are served by a pool */
+    static constexpr bool pooled =
+        slot_size <= max_pooled_size && alignof(T) <= alignment;
+
+    pool_allocator() noexcept = default;
+    template <typename U> pool_allocator(const pool_allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        void *ptr;
+        if constexpr (pooled) {
+            if (n == 1) {
+                ptr = fixed_pool<slot_size>::instance().allocate();
+                if (ptr == nullptr) {
+                    throw std::bad_alloc();
+                }
+                return static_cast<T *>(ptr);
+            }
+        }
+        return allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        if constexpr (pooled) {
+            if (n == 1) {
+                fixed_pool<slot_size>::instance().deallocate(ptr);
+                return;
+            }
+        }
+        allocator<T>().deallocate(ptr, n);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const pool_allocator<T> &, const pool_allocator<U> &) noexcept {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const pool_allocator<T> &, const pool_allocator<U> &) noexcept {
+    return false;
+}
+
+} // namespace mm
+
+#endif /* MM_ALLOCATOR_HPP */
@@ -0,0 +1,325 @@
+/**
+ * @file mm_ext.h
+ * @brief Extensions to the mm.h interface implemented by mm.c
+ *
+ * mm.h is the fixed interface the lab's drivers compile against; everything
+ * mm.c offers beyond malloc/free/realloc/calloc is declared here.
+ *
+ * @author Yi-Jing <ysie@andrew.cmu.edu>
+ */
+
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef DRIVER
+/*
+ * The aligned allocation functions and malloc_usable_size(). Outside the
+ * driver build mm.c defines them under their C library names, declared by
+ * <stdlib.h> and <malloc.h>.
+ */
+int mm_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *mm_aligned_alloc(size_t alignment, size_t size);
+void *mm_memalign(size_t alignment, size_t size);
+void *mm_valloc(size_t size);
+void *mm_pvalloc(size_t size);
+size_t mm_malloc_usable_size(void *ptr);
+#endif
+
+#ifndef DRIVER
+/*
+ * mm.h declares these for the driver. Programs linked against the library
+ * call mm_init() to start a new heap, e.g. after mm_set_policy(), and
+ * mm_checkheap() to check it.
+ */
+bool mm_init(void);
+bool mm_checkheap(int line);
+#endif
+
+/** @brief Keep every segregated list in address order */
+#define MM_ADDR_ORDER_ALL (~0u)
+
+/**
+ * @brief Selects which size classes keep their free list in address order.
+ *
+ * Bit i stands for seglist[i]; classes whose bit is clear stay LIFO. The
+ * policy takes effect at the next mm_init(). The minilist stays LIFO (all its
+ * blocks have the same size) and the largest class is always ordered by
+ * (size, address).
+ *
+ * @param[in] classes bit mask of the address-ordered classes
+ */
+void mm_set_addr_order(unsigned int classes);
+
+/**
+ * @brief The tunable parts of the allocator.
+ *
+ * Free blocks of 32 bytes and up are kept in `num_classes` size classes, the
+ * last of which is a tree holding every larger block. Class 0 holds the
+ * blocks below 2^class_shift bytes; from there each power of two is split
+ * into `class_steps` classes of equal width.
+ */
+typedef struct {
+    /** @brief Name shown by the replay driver */
+    const char *name;
+    /** @brief log2 of the first size past class 0 (4 to 20) */
+    unsigned int class_shift;
+    /** @brief Classes per power of two (1, 2 or 4) */
+    unsigned int class_steps;
+    /** @brief Number of classes, the tree included (2 to 32) */
+    unsigned int num_classes;
+    /** @brief Further blocks of a class compared with the first that fits,
+     * for a tighter fit (0: first fit) */
+    unsigned int fit_depth;
+    /** @brief Least number of bytes the heap grows by */
+    size_t chunk_size;
+    /** @brief Also grow by at least heap size / 2^growth_shift (0: no) */
+    unsigned int growth_shift;
+    /** @brief Serve the smallest requests from 16-byte miniblocks */
+    bool mini_blocks;
+} mm_policy_t;
+
+/**
+ * @brief Looks up one of the policies mm.c comes with.
+ *
+ * "default" is the layout the allocator is tuned for. "fine" has two classes
+ * per power of two and compares 8 candidates, "best" compares 16 in the
+ * default classes, "fast" grows the heap by 64 KiB or an eighth of its size,
+ * and "nomini" gives the smallest requests 32-byte blocks.
+ *
+ * @param[in] name the name of the preset
+ * @return the preset, or NULL if there is none of that name
+ */
+const mm_policy_t *mm_policy_preset(const char *name);
+
+/**
+ * @brief Selects the allocator policy, from the next mm_init() on.
+ *
+ * The policy is copied. Several policies can be replayed in one binary by
+ * switching between them before each mm_init().
+ *
+ * @param[in] policy the policy, or NULL for "default"
+ * @return false, leaving the policy unchanged, if a field is out of range
+ */
+bool mm_set_policy(const mm_policy_t *policy);
+
+/**
+ * @brief Makes the heap grow in whole 2 MiB transparent huge pages.
+ *
+ * Every extension of the heap then ends on a huge page boundary and is
+ * advised with MADV_HUGEPAGE, which cuts the TLB misses of walking the free
+ * lists and boundary tags of a large heap, for up to 2 MiB more heap. Takes
+ * effect at the next mm_init(); MM_THP=1 in the environment does the same
+ * under LIBMM.
+ *
+ * @param[in] enable true for huge pages
+ */
+void mm_set_huge_pages(bool enable);
+
+/**
+ * @brief Gives the heap a background maintenance thread.
+ *
+ * The thread does in small time slices what would otherwise stall whichever
+ * call triggers it: it gives the free pages back at memory pressure (see
+ * mm_set_heap_limit()) instead of the allocation that met it, returns the
+ * slack realloc() left in blocks that stopped growing, and puts the heads of
+ * the LIFO free lists in address order. It only takes the heap lock when no
+ * call holds it, for 20 us at most, and runs at SCHED_IDLE priority. Heaps
+ * with NUMA arenas or images get no thread. Takes effect at the next
+ * mm_init(), except that disabling it stops a running thread at once;
+ * MM_MAINT=1 in the environment enables it under LIBMM. A driver that resets
+ * or releases the heap memory must disable it first.
+ *
+ * @param[in] enable true for a thread
+ */
+void mm_set_maintenance(bool enable);
+
+/**
+ * @brief Splits the heap into one arena per NUMA node (LIBMM only).
+ *
+ * Each arena grows in its own 2 MiB extents whose pages are bound to its
+ * node, threads allocate from the arena of the node they run on, and a
+ * block freed from another node goes back to the arena it came from. With
+ * more arenas than the machine has nodes, threads are spread over them by
+ * thread id instead, which simulates NUMA on any machine. Takes effect at
+ * the next mm_init(); MM_NUMA=<arenas> in the environment does the same.
+ *
+ * @param[in] arenas 1 for one per node, more to simulate as many (up to 8),
+ * 0 for a single heap
+ */
+void mm_set_numa(unsigned int arenas);
+
+/**
+ * @brief Returns how many bytes may be used at `ptr`, which is at least what
+ * was requested for it.
+ * @param[in] ptr a block from malloc() and friends, or NULL (gives 0)
+ */
+size_t mm_usable_size(void *ptr);
+
+/**
+ * @brief malloc() that also reports the real capacity of the block.
+ *
+ * Growable buffers can fill the whole block before they need to realloc().
+ *
+ * @param[in] size number of bytes requested
+ * @param[out] actual set to mm_usable_size() of the result
+ * @return the block, or NULL if out of memory
+ */
+void *mm_malloc_at_least(size_t size, size_t *actual);
+
+/**
+ * @brief Grows a block in place to hold `size` bytes, without moving it.
+ *
+ * This succeeds when the block is followed by enough free space or ends the
+ * heap, so that a ring buffer or arena chunk can try it before chaining a new
+ * segment. Shrinking requests succeed and leave the block as it is.
+ *
+ * @param[in] ptr a block from malloc() and friends
+ * @param[in] size number of bytes the block must hold
+ * @return true on success; false leaves the block and the heap unchanged
+ */
+bool mm_try_expand(void *ptr, size_t size);
+
+/**
+ * @brief Called on memory pressure, with the heap size in bytes and the
+ * argument it was registered with
+ */
+typedef void (*mm_pressure_callback_t)(size_t heap_size, void *arg);
+
+/**
+ * @brief Limits the size of the heap, from now on.
+ *
+ * Allocations that would take the heap past `hard` fail, as they would when
+ * the system is out of memory. Growing the heap to `soft`, and by every
+ * further eighth of it, is memory pressure: the heap stops growing faster
+ * than it must, the pages inside its free blocks are given back to the
+ * system (without huge pages or an image), and the pressure
+ * callbacks are called. An allocation failing at the hard limit calls them
+ * too. Under LIBMM, MM_LIMIT=<soft>[,<hard>] in the environment does the
+ * same for preloaded programs.
+ *
+ * @param[in] soft heap size at which memory pressure starts, 0 for none
+ * @param[in] hard heap size never passed, 0 for none
+ */
+void mm_set_heap_limit(size_t soft, size_t hard);
+
+/**
+ * @brief Registers a function to call on memory pressure.
+ *
+ * Callbacks are called in the order they were registered, by the call into
+ * the allocator that met the pressure once it has released the heap, so
+ * that they can free the objects of a cache. Pressure met while they run
+ * does not call them again.
+ *
+ * @param[in] fn the callback
+ * @param[in] arg passed to it
+ * @return false if 8 callbacks are registered already
+ */
+bool mm_add_pressure_callback(mm_pressure_callback_t fn, void *arg);
+
+/** @brief Check the pointers passed to free() and realloc() */
+#define MM_HARDEN_CHECKS 0x1u
+/** @brief Also end every block with a canary (implies MM_HARDEN_CHECKS) */
+#define MM_HARDEN_CANARY 0x2u
+
+/**
+ * @brief Selects the hardening of the heap, from the next mm_init() on.
+ *
+ * MM_HARDEN_CHECKS makes free() and realloc() abort with a report on
+ * pointers outside the heap, double frees and blocks whose header does not
+ * match their neighbor's, at the cost of a few loads per free.
+ * MM_HARDEN_CANARY adds an 8-byte canary to each block that also catches
+ * writes past the end of its payload, which costs space. With canaries, one
+ * malloc() in `guard_interval` (0 for none) also gets a PROT_NONE guard page
+ * right after its payload. Under LIBMM, MM_HARDEN=<flags>[,<guard_interval>]
+ * in the environment does the same for preloaded programs.
+ *
+ * @param[in] flags MM_HARDEN_* bits, 0 for none
+ * @param[in] guard_interval sampling interval of guard pages
+ */
+void mm_set_hardening(unsigned int flags, unsigned int guard_interval);
+
+/**
+ * @brief Holds freed blocks back from reuse, from the next mm_init() on.
+ *
+ * free() poisons the payload of a block (up to its first KiB) and queues it
+ * instead of freeing it; once the queue holds more than `bytes`, the oldest
+ * block is checked and really freed. A write to it in the meantime aborts
+ * with the block and the address of the call that allocated it, and a
+ * second free() of a queued block is reported as a double free. Blocks
+ * carry the allocation site in 8 extra bytes (except miniblocks). Under
+ * LIBMM, MM_QUARANTINE=<bytes> in the environment does the same.
+ *
+ * @param[in] bytes the most bytes held back, 0 to free blocks immediately
+ */
+void mm_set_quarantine(size_t bytes);
+
+/*
+ * Heap images and shared heaps, in the LIBMM build only. With
+ * MM_IMAGE=<file> in the environment the heap is kept in that file, mapped
+ * at a fixed address (MM_IMAGE_BASE=<address> to change it), and a process
+ * that opens a saved image resumes allocating on the heap it holds. With
+ * MM_SHM=<file> (in a build with COMPACT_LINKS) every process that opens the
+ * file allocates on the same heap, wherever each maps it; pointers into it
+ * must then be stored as offsets, e.g. from mm_image_root().
+ */
+
+/**
+ * @brief Returns the pointer stored by mm_set_image_root().
+ * @return the root, or NULL for a new heap or without an image
+ */
+void *mm_image_root(void);
+
+/**
+ * @brief Stores the pointer from which the program finds its objects in
+ * the heap image or shared heap. No effect on a private heap.
+ * @param[in] root a block of the heap, or NULL
+ */
+void mm_set_image_root(void *root);
+
+/**
+ * @brief Saves the heap image and writes it to its file.
+ *
+ * This also happens at exit. A shared heap is never saved. The saved image
+ * is only valid until the next call into the allocator: a process that dies
+ * after it leaves a file that mm_init() refuses to resume.
+ *
+ * @return false without an image or if it could not be written
+ */
+bool mm_save_image(void);
+
+/** @brief A group of objects that are all released at once */
+typedef struct mm_region mm_region_t;
+
+/**
+ * @brief Creates an empty region.
+ * @param[in] chunk_size bytes to take from the heap at a time, 0 for default
+ * @return the region, or NULL if out of memory
+ */
+mm_region_t *mm_region_create(size_t chunk_size);
+
+/**
+ * @brief Allocates `size` bytes from a region by bumping a pointer.
+ *
+ * The object is 16-byte aligned and cannot be freed on its own.
+ *
+ * @return the object, or NULL if out of memory
+ */
+void *mm_region_alloc(mm_region_t *region, size_t size);
+
+/**
+ * @brief Frees every object allocated from the region, and the region.
+ */
+void mm_region_destroy(mm_region_t *region);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MM_EXT_H */
@@ -0,0 +1,1456 @@
+/**
+ * @file replay.c
+ * @brief A trace replay driver that reports per-operation tail latency
+ *
+ * The lab's mdriver only reports the average throughput of each trace, which
+ * hides the occasional malloc() that has to call extend_heap() or scan a long
+ * segregated list. This driver replays the same .rep traces (see
+ * traces/README) against mm.c and, besides utilization and KOPS, records the
+ * latency of every single request into log-linear (HDR-style) histograms.
+ *
+ * The histograms are split by operation type (a/r/f) and by path:
+ *  - fast: the request was served from the existing heap
+ *  - slow: the request had to grow the heap through extend_heap()
+ *
+ * For every trace the p50/p90/p99/p99.9/max latencies of each histogram are
+ * printed, followed by the individual requests behind the worst outliers so
+ * they can be replayed in isolation.
+ *
+ * With -p the throughput pass is additionally wrapped in hardware performance
+ * counters (cycles, instructions, L1D/LLC/dTLB misses and branch misses,
+ * counted in user space through perf_event_open) and each counter is reported
+ * per request. Most of the allocator's cost is pointer chasing through the
+ * free lists and boundary tags, so cache and TLB misses per request are the
+ * numbers to compare when changing the block layout. Counters the machine
+ * or kernel does not expose are reported as n/a.
+ *
+ * Build it the same way as mdriver, with gcc or clang, next to memlib.c,
+ * memlib.h and mm.h from the handout (they are not in this repository):
+ *
+ *     gcc -O2 -DDRIVER -o replay replay.c mm.c memlib.c -lm -lpthread
+ *
+ * Usage: replay [-l] [-p] [-t] [-a | -c] [-P <policy>[,<policy>...]]
+ *               [-T [-w <weight>] | -j <n> [-r <n>]] [-k <n>]
+ *               [-H <flags>[,<n>]] [-q <bytes>] [-L <soft>[,<hard>]] [-m]
+ *               <trace.rep>...
+ *  -l      record per-operation latency histograms
+ *  -p      report hardware performance counters per operation
+ *  -t      grow the heap in transparent huge pages (with -p, compare the
+ *          dTLB misses to a run without)
+ *  -a      keep the free lists in address order instead of LIFO
+ *  -c      compare LIFO and address-ordered free lists on every trace
+ *  -P      replay every trace with each of the named policy presets (see
+ *          mm_policy_preset()) and print them side by side
+ *  -T      search the policy fields for the best Perf Index on the traces
+ *          and print the Pareto front of utilization and throughput
+ *  -w      weight of utilization in the Perf Index searched by -T (0 to 1,
+ *          default 0.6)
+ *  -j      replay in <n> worker processes pinned to CPUs (0: one per CPU)
+ *          and report medians with confidence intervals
+ *  -r      replay every trace <n> times with -j (default 5)
+ *  -k <n>  number of outliers to report per trace (default 8)
+ *  -H      hardening flags (see mm_set_hardening()) and guard page interval
+ *  -q      quarantine size in bytes (see mm_set_quarantine())
+ *  -L      soft and hard limit on the heap size in bytes (see
+ *          mm_set_heap_limit())
+ *  -m      run the background maintenance thread (see mm_set_maintenance());
+ *          compare the latencies of -l with and without it
+ *
+ * @author Yi-Jing <ysie@andrew.cmu.edu>
+ */
+
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memlib.h"
+#include "mm.h"
+#include "mm_ext.h"
+
+/* Basic constants */
+
+/** @brief Full utilization points are granted above this ratio */
+static const double util_target = 0.74;
+
+/** @brief Full throughput points are granted above this many KOPS */
+static const double kops_target = 8009.0;
+
+/** @brief Weight of utilization in the performance index */
+static const double util_weight = 0.60;
+
+/** @brief Whether every heap gets the maintenance thread (-m) */
+static bool maintenance = false;
+
+/** @brief Number of sub-buckets per power of two (precision ~3%) */
+#define SUB_BUCKETS 32
+
+/** @brief log2 of SUB_BUCKETS */
+static const int sub_bits = 5;
+
+/** @brief Number of powers of two covered by a histogram */
+#define NUM_EXPONENTS 64
+
+/** @brief Maximum number of outliers remembered per trace */
+#define MAX_OUTLIERS 64
+
+/** @brief Maximum number of allocator configurations compared in one run */
+#define MAX_CONFIGS 8
+
+/** @brief Number of hardware counters sampled with -p */
+#define NUM_COUNTERS 6
+
+/** @brief The kinds of requests found in a trace */
+typedef enum { OP_ALLOC, OP_REALLOC, OP_FREE, NUM_OPS } op_type_t;
+
+/** @brief The path a request took through the allocator */
+typedef enum { PATH_FAST, PATH_SLOW, NUM_PATHS } op_path_t;
+
+static const char op_names[NUM_OPS] = {'a', 'r', 'f'};
+static const char *path_names[NUM_PATHS] = {"fast", "slow"};
+
+/** @brief A hardware event to be counted through perf_event_open */
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} counter_spec_t;
+
+/** @brief Encodes a read miss of the given cache for PERF_TYPE_HW_CACHE */
+#define CACHE_READ_MISS(cache)                                                 \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                            \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const counter_spec_t counter_specs[NUM_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instrs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1D-miss", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {"LLC-miss", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {"dTLB-miss", PERF_TYPE_HW_CACHE,
+     CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {"br-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+/** @brief The open counters of one run; -1 marks an unavailable event */
+typedef struct {
+    int fds[NUM_COUNTERS];
+} counters_t;
+
+/** @brief An allocator configuration to replay the traces with */
+typedef struct {
+    const char *name;
+    unsigned int addr_order;   // classes passed to mm_set_addr_order()
+    const mm_policy_t *policy; // passed to mm_set_policy(), NULL: default
+} config_t;
+
+static const config_t lifo_config = {"lifo", 0, NULL};
+static const config_t addr_config = {"addr", MM_ADDR_ORDER_ALL, NULL};
+static const config_t compare_configs[] = {
+    {"lifo", 0, NULL},
+    {"addr", MM_ADDR_ORDER_ALL, NULL},
+};
+
+/** @brief Results of one configuration accumulated over all traces */
+typedef struct {
+    double util_sum;
+    double kops_sum;
+    size_t util_traces;
+    size_t kops_traces;
+} summary_t;
+
+/** @brief One request of a trace */
+typedef struct {
+    op_type_t type;
+    size_t id;
+    size_t size;
+} op_t;
+
+/** @brief A trace loaded into memory */
+typedef struct {
+    const char *name;
+    int weight;
+    size_t num_ids;
+    size_t num_ops;
+    op_t *ops;
+} trace_t;
+
+/** @brief A log-linear latency histogram in nanoseconds */
+typedef struct {
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[NUM_EXPONENTS * SUB_BUCKETS];
+} histogram_t;
+
+/** @brief A single slow request */
+typedef struct {
+    size_t index;
+    uint64_t ns;
+    op_path_t path;
+} outlier_t;
+
+/** @brief The result of replaying one trace */
+typedef struct {
+    double util;
+    double secs;
+    bool counted[NUM_COUNTERS];
+    uint64_t counts[NUM_COUNTERS];
+    size_t num_outliers;
+    outlier_t outliers[MAX_OUTLIERS];
+    histogram_t hist[NUM_OPS][NUM_PATHS];
+} result_t;
+
+/*
+ * ---------------------------------------------------------------------------
+ *                              HISTOGRAMS
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * @brief Maps a latency onto its histogram bucket
+ *
+ * Values below SUB_BUCKETS get a bucket of their own; above that, every power
+ * of two is split into SUB_BUCKETS equally sized buckets.
+ *
+ * @param[in] ns the latency in nanoseconds
+ * @return the bucket index
+ */
+static size_t bucket_index(uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return (size_t)ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - sub_bits;
+    size_t sub = (size_t)(ns >> shift) - SUB_BUCKETS;
+    return (size_t)(shift + 1) * SUB_BUCKETS + sub;
+}
+
+/**
+ * @brief Returns the largest latency that falls into the given bucket
+ * @param[in] index the bucket index
+ * @return the upper bound of the bucket in nanoseconds
+ */
+static uint64_t bucket_upper(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = (int)(index / SUB_BUCKETS) - 1;
+    uint64_t sub = index % SUB_BUCKETS + SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * @brief Records one latency sample
+ * @param[in] hist the histogram to update
+ * @param[in] ns the latency in nanoseconds
+ */
+static void hist_record(histogram_t *hist, uint64_t ns) {
+    hist->buckets[bucket_index(ns)]++;
+    hist->count++;
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+}
+
+/**
+ * @brief Computes a percentile of the recorded samples
+ * @param[in] hist the histogram to query
+ * @param[in] pct the percentile, between 0 and 100
+ * @return the latency below which `pct` percent of the samples fall
+ */
+static uint64_t hist_percentile(const histogram_t *hist, double pct) {
+    uint64_t rank = (uint64_t)((pct / 100.0) * (double)hist->count + 0.5);
+    uint64_t seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (size_t i = 0; i < NUM_EXPONENTS * SUB_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = bucket_upper(i);
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                          PERFORMANCE COUNTERS
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * @brief Opens every counter in `counter_specs`, initially disabled
+ *
+ * Each event is opened on its own rather than as a group, so that a single
+ * event the PMU does not support does not take the others down with it.
+ *
+ * @param[out] counters the opened counters
+ * @return true if at least one counter could be opened
+ */
+static bool counters_open(counters_t *counters) {
+    bool any = false;
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_specs[i].type;
+        attr.config = counter_specs[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[i] =
+            (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        any = any || counters->fds[i] >= 0;
+    }
+    return any;
+}
+
+/**
+ * @brief Closes all counters
+ * @param[in] counters the counters to close
+ */
+static void counters_close(counters_t *counters) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) {
+            close(counters->fds[i]);
+        }
+    }
+}
+
+/**
+ * @brief Resets and enables all counters
+ * @param[in] counters the counters to start
+ */
+static void counters_start(const counters_t *counters) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/**
+ * @brief Disables all counters and stores their values in `res`
+ *
+ * If the kernel had to multiplex the PMU, the count is scaled up by the
+ * fraction of time the event was actually scheduled.
+ *
+ * @param[in] counters the counters to stop
+ * @param[out] res receives the counts
+ */
+static void counters_stop(const counters_t *counters, result_t *res) {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) {
+            ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        uint64_t data[3]; // value, time enabled, time running
+        res->counted[i] = false;
+        if (counters->fds[i] < 0 ||
+            read(counters->fds[i], data, sizeof(data)) != sizeof(data) ||
+            data[2] == 0) {
+            continue;
+        }
+        res->counted[i] = true;
+        res->counts[i] = data[0];
+        if (data[2] < data[1]) {
+            res->counts[i] =
+                (uint64_t)((double)data[0] * (double)data[1] / (double)data[2]);
+        }
+    }
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                               TRACES
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * @brief Reads a trace file into memory
+ * @param[in] name path to the .rep file
+ * @param[out] trace the loaded trace
+ * @return true if the file was parsed successfully
+ */
+static bool load_trace(const char *name, trace_t *trace) {
+    FILE *fp = fopen(name, "r");
+    unsigned long max_alloc;
+    if (fp == NULL) {
+        fprintf(stderr, "replay: could not open %s\n", name);
+        return false;
+    }
+    trace->name = name;
+    if (fscanf(fp, "%d %zu %zu %lu", &trace->weight, &trace->num_ids,
+               &trace->num_ops, &max_alloc) != 4) {
+        fprintf(stderr, "replay: bad header in %s\n", name);
+        fclose(fp);
+        return false;
+    }
+    trace->ops = calloc(trace->num_ops, sizeof(op_t));
+    if (trace->ops == NULL) {
+        fclose(fp);
+        return false;
+    }
+    for (size_t i = 0; i < trace->num_ops; i++) {
+        op_t *op = &trace->ops[i];
+        char type;
+        if (fscanf(fp, " %c %zu", &type, &op->id) != 2 ||
+            op->id >= trace->num_ids) {
+            fprintf(stderr, "replay: bad request %zu in %s\n", i, name);
+            free(trace->ops);
+            fclose(fp);
+            return false;
+        }
+        if (type == 'f') {
+            op->type = OP_FREE;
+            continue;
+        }
+        op->type = (type == 'a') ? OP_ALLOC : OP_REALLOC;
+        if (fscanf(fp, "%zu", &op->size) != 1) {
+            fprintf(stderr, "replay: bad request %zu in %s\n", i, name);
+            free(trace->ops);
+            fclose(fp);
+            return false;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+/**
+ * @brief Reads several trace files into memory
+ * @param[in] names paths to the .rep files
+ * @param[in] num_names number of paths
+ * @param[out] traces the traces that could be loaded, to be released with
+ * free_traces()
+ * @return the number of traces loaded
+ */
+static size_t load_traces(char **names, size_t num_names, trace_t **traces) {
+    size_t num_traces = 0;
+    *traces = calloc(num_names, sizeof(trace_t));
+    if (*traces == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < num_names; i++) {
+        if (load_trace(names[i], &(*traces)[num_traces])) {
+            num_traces++;
+        }
+    }
+    return num_traces;
+}
+
+/**
+ * @brief Releases the traces of load_traces()
+ * @param[in] traces the traces
+ * @param[in] num_traces number of traces
+ */
+static void free_traces(trace_t *traces, size_t num_traces) {
+    for (size_t i = 0; i < num_traces; i++) {
+        free(traces[i].ops);
+    }
+    free(traces);
+}
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Performs a single request of a trace
+ * @param[in] op the request
+ * @param[in,out] ptrs the payload pointer of every id
+ * @return false if the allocator failed the request
+ */
+static bool do_op(const op_t *op, void **ptrs) {
+    switch (op->type) {
+    case OP_ALLOC:
+        ptrs[op->id] = mm_malloc(op->size);
+        return ptrs[op->id] != NULL;
+    case OP_REALLOC:
+        ptrs[op->id] = mm_realloc(ptrs[op->id], op->size);
+        return ptrs[op->id] != NULL;
+    default:
+        mm_free(ptrs[op->id]);
+        ptrs[op->id] = NULL;
+        return true;
+    }
+}
+
+/**
+ * @brief Remembers a request if it is among the slowest seen so far
+ *
+ * The outliers are kept sorted, slowest first.
+ *
+ * @param[in,out] res the result of the current trace
+ * @param[in] max_outliers number of outliers to keep
+ * @param[in] index the position of the request in the trace
+ * @param[in] ns its latency
+ * @param[in] path the path it took
+ */
+static void record_outlier(result_t *res, size_t max_outliers, size_t index,
+                           uint64_t ns, op_path_t path) {
+    size_t pos = res->num_outliers;
+    if (pos == max_outliers) {
+        if (max_outliers == 0 || res->outliers[pos - 1].ns >= ns) {
+            return;
+        }
+        pos--;
+    } else {
+        res->num_outliers++;
+    }
+    while (pos > 0 && res->outliers[pos - 1].ns < ns) {
+        res->outliers[pos] = res->outliers[pos - 1];
+        pos--;
+    }
+    res->outliers[pos].index = index;
+    res->outliers[pos].ns = ns;
+    res->outliers[pos].path = path;
+}
+
+/**
+ * @brief Replays a trace once against a fresh heap
+ *
+ * With `timed` set every request is timed individually and recorded in the
+ * histograms; otherwise only the total run time is measured, so the reported
+ * throughput is not skewed by the cost of reading the clock.
+ *
+ * @param[in] trace the trace to replay
+ * @param[out] res utilization, run time and (when timed) latencies
+ * @param[in] timed whether to record per-request latency
+ * @param[in] max_outliers number of outliers to keep
+ * @param[in] counters hardware counters to wrap the run in, or NULL
+ * @return false if the allocator failed
+ */
+static bool replay(const trace_t *trace, result_t *res, bool timed,
+                   size_t max_outliers, const counters_t *counters) {
+    void **ptrs = calloc(trace->num_ids, sizeof(void *));
+    size_t *sizes = calloc(trace->num_ids, sizeof(size_t));
+    size_t live = 0;
+    size_t peak = 0;
+    bool ok = true;
+
+    if (ptrs == NULL || sizes == NULL) {
+        free(ptrs);
+        free(sizes);
+        return false;
+    }
+    // The maintenance thread must be done with the old heap before it goes
+    mm_set_maintenance(false);
+    mem_reset_brk();
+    mm_set_maintenance(maintenance);
+    if (!mm_init()) {
+        fprintf(stderr, "replay: mm_init failed on %s\n", trace->name);
+        free(ptrs);
+        free(sizes);
+        return false;
+    }
+
+    if (counters != NULL) {
+        counters_start(counters);
+    }
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < trace->num_ops && ok; i++) {
+        const op_t *op = &trace->ops[i];
+        if (timed) {
+            size_t heap_before = mem_heapsize();
+            uint64_t t0 = now_ns();
+            ok = do_op(op, ptrs);
+            uint64_t ns = now_ns() - t0;
+            op_path_t path =
+                mem_heapsize() != heap_before ? PATH_SLOW : PATH_FAST;
+            hist_record(&res->hist[op->type][path], ns);
+            record_outlier(res, max_outliers, i, ns, path);
+        } else {
+            ok = do_op(op, ptrs);
+        }
+
+        // Keep track of the peak number of live payload bytes
+        live -= sizes[op->id];
+        sizes[op->id] = (op->type == OP_FREE) ? 0 : op->size;
+        live += sizes[op->id];
+        if (live > peak) {
+            peak = live;
+        }
+    }
+    res->secs = (double)(now_ns() - start) / 1e9;
+    if (counters != NULL) {
+        counters_stop(counters, res);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "replay: allocator failed on %s\n", trace->name);
+    }
+    res->util = (double)peak / (double)mem_heapsize();
+    free(ptrs);
+    free(sizes);
+    return ok;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                              REPORTING
+ * ---------------------------------------------------------------------------
+ */
+
+/**
+ * @brief Prints the latency percentiles and outliers of one trace
+ * @param[in] trace the replayed trace
+ * @param[in] res its timed result
+ */
+static void print_latency(const trace_t *trace, const result_t *res) {
+    printf("  %-2s %-4s %10s %8s %8s %8s %8s %10s\n", "op", "path", "count",
+           "p50", "p90", "p99", "p99.9", "max(ns)");
+    for (int type = 0; type < NUM_OPS; type++) {
+        for (int path = 0; path < NUM_PATHS; path++) {
+            const histogram_t *hist = &res->hist[type][path];
+            if (hist->count == 0) {
+                continue;
+            }
+            printf("  %-2c %-4s %10" PRIu64 " %8" PRIu64 " %8" PRIu64
+                   " %8" PRIu64 " %8" PRIu64 " %10" PRIu64 "\n",
+                   op_names[type], path_names[path], hist->count,
+                   hist_percentile(hist, 50.0), hist_percentile(hist, 90.0),
+                   hist_percentile(hist, 99.0), hist_percentile(hist, 99.9),
+                   hist->max);
+        }
+    }
+    if (res->num_outliers > 0) {
+        printf("  worst requests:\n");
+    }
+    for (size_t i = 0; i < res->num_outliers; i++) {
+        const outlier_t *out = &res->outliers[i];
+        const op_t *op = &trace->ops[out->index];
+        printf("    #%-8zu %c %-6zu %10zu bytes %10" PRIu64 " ns  %s\n",
+               out->index, op_names[op->type], op->id,
+               op->type == OP_FREE ? 0 : op->size, out->ns,
+               path_names[out->path]);
+    }
+}
+
+/**
+ * @brief Prints the hardware counters of one trace, per request
+ * @param[in] trace the replayed trace
+ * @param[in] res its result
+ */
+static void print_counters(const trace_t *trace, const result_t *res) {
+    printf(" ");
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        printf(" %s/op ", counter_specs[i].name);
+        if (res->counted[i]) {
+            printf("%.2f", (double)res->counts[i] / (double)trace->num_ops);
+        } else {
+            printf("n/a");
+        }
+    }
+    if (res->counted[0] && res->counted[1] && res->counts[0] != 0) {
+        printf("  IPC %.2f", (double)res->counts[1] / (double)res->counts[0]);
+    }
+    printf("\n");
+}
+
+/**
+ * @brief Adds the result of one trace to the totals of its configuration
+ * @param[in,out] sum the accumulated results
+ * @param[in] trace the replayed trace, whose weight says what counts
+ * @param[in] res its result
+ */
+static void summary_add(summary_t *sum, const trace_t *trace,
+                        const result_t *res) {
+    // Weight 0 ignores the trace, 2 is utilization only, 3 is throughput
+    // only
+    if (trace->weight == 1 || trace->weight == 2) {
+        sum->util_sum += res->util;
+        sum->util_traces++;
+    }
+    if (trace->weight == 1 || trace->weight == 3) {
+        sum->kops_sum += (double)trace->num_ops / res->secs / 1000.0;
+        sum->kops_traces++;
+    }
+}
+
+/**
+ * @brief Averages the results of a configuration over the traces
+ * @param[in] sum the accumulated results
+ * @param[out] util the average utilization
+ * @param[out] kops the average throughput
+ */
+static void summary_average(const summary_t *sum, double *util,
+                            double *kops) {
+    *util = sum->util_traces ? sum->util_sum / sum->util_traces : 0;
+    *kops = sum->kops_traces ? sum->kops_sum / sum->kops_traces : 0;
+}
+
+/**
+ * @brief Computes the README's performance index, from 0 to 100
+ * @param[in] util the average utilization
+ * @param[in] kops the average throughput
+ * @param[in] weight the weight of utilization, the rest going to throughput
+ */
+static double perf_index(double util, double kops, double weight) {
+    double util_score = util / util_target < 1 ? util / util_target : 1;
+    double kops_score = kops / kops_target < 1 ? kops / kops_target : 1;
+    return 100.0 * (weight * util_score + (1.0 - weight) * kops_score);
+}
+
+/**
+ * @brief Prints the averages over all traces in the README's format
+ * @param[in] config the allocator configuration that was replayed
+ * @param[in] sum the accumulated results
+ */
+static void print_summary(const config_t *config, const summary_t *sum) {
+    double util;
+    double kops;
+    summary_average(sum, &util, &kops);
+    printf("%-7s Utilization %5.1f%%  Throughput %8.0f Kops  "
+           "Perf Index %5.1f\n",
+           config->name, util * 100.0, kops,
+           perf_index(util, kops, util_weight));
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                                TUNING
+ *
+ * With -T the driver searches the allocator policies (mm_policy_t) for the
+ * one that scores best on the given traces, instead of replaying a fixed
+ * configuration. Each field varies over a few values, the first of which is
+ * the default preset. The search is a coordinate descent: starting from the
+ * default, every value of one field is tried with the others held, the best
+ * policy so far is kept, and the fields are swept again until a sweep
+ * brings no improvement. That takes tens of evaluations instead of the
+ * thousands of the full grid, each being a replay of every trace.
+ *
+ * Policies are ranked by the Perf Index with utilization weighted by -w
+ * (the README's 60% by default), ties going to the better utilization,
+ * then throughput. Since the index saturates at the targets, the Pareto
+ * front of all the policies evaluated is printed as well: those that no
+ * other one beats on both utilization and throughput, from which a service
+ * can pick its own trade-off.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief Number of policy fields the tuner varies */
+#define NUM_TUNE_PARAMS 7
+
+/** @brief Most values tried for one field */
+#define MAX_TUNE_VALUES 4
+
+/** @brief Most policies evaluated by one search */
+#define MAX_TUNE_POINTS 256
+
+/** @brief A policy field and the values it takes, the default first */
+typedef struct {
+    const char *name;
+    size_t num_values;
+    size_t values[MAX_TUNE_VALUES];
+} tune_param_t;
+
+static const tune_param_t tune_params[NUM_TUNE_PARAMS] = {
+    {"shift", 3, {6, 5, 7}},                             // class_shift
+    {"steps", 3, {1, 2, 4}},                             // class_steps
+    {"tree", 3, {16, 14, 18}},                           // log2 of the tree
+    {"depth", 3, {0, 4, 16}},                            // fit_depth
+    {"chunk", 4, {1 << 12, 1 << 14, 1 << 16, 1 << 18}}, // chunk_size
+    {"growth", 3, {0, 3, 5}},                            // growth_shift
+    {"mini", 2, {1, 0}},                                 // mini_blocks
+};
+
+/** @brief A policy evaluated by the tuner */
+typedef struct {
+    size_t choice[NUM_TUNE_PARAMS]; // index of each field's value
+    double util;
+    double kops;
+    double score;
+} tune_point_t;
+
+/**
+ * @brief Builds the policy of a choice of values
+ * @param[in] choice the index of each field's value
+ * @param[out] policy the policy
+ */
+static void tune_policy(const size_t *choice, mm_policy_t *policy) {
+    size_t value[NUM_TUNE_PARAMS];
+    for (size_t i = 0; i < NUM_TUNE_PARAMS; i++) {
+        value[i] = tune_params[i].values[choice[i]];
+    }
+    policy->name = "tune";
+    policy->class_shift = (unsigned int)value[0];
+    policy->class_steps = (unsigned int)value[1];
+    // One class per step up to the tree, which follows the last one
+    policy->num_classes = (unsigned int)((value[2] - value[0]) * value[1] + 2);
+    policy->fit_depth = (unsigned int)value[3];
+    policy->chunk_size = value[4];
+    policy->growth_shift = (unsigned int)value[5];
+    policy->mini_blocks = value[6] != 0;
+}
+
+/**
+ * @brief Prints the column names of print_tune_point()
+ */
+static void print_tune_header(void) {
+    for (size_t i = 0; i < NUM_TUNE_PARAMS; i++) {
+        printf("%7s", tune_params[i].name);
+    }
+    printf("  %6s %10s %10s\n", "util", "Kops", "Perf Index");
+}
+
+/**
+ * @brief Prints the values of a policy and its results
+ * @param[in] point the evaluated policy
+ */
+static void print_tune_point(const tune_point_t *point) {
+    for (size_t i = 0; i < NUM_TUNE_PARAMS; i++) {
+        printf("%7zu", tune_params[i].values[point->choice[i]]);
+    }
+    printf("  %5.1f%% %10.0f %10.1f\n", point->util * 100.0, point->kops,
+           point->score);
+}
+
+/**
+ * @brief Whether a policy ranks above another
+ * @param[in] a an evaluated policy
+ * @param[in] b another one
+ */
+static bool tune_better(const tune_point_t *a, const tune_point_t *b) {
+    if (a->score != b->score) {
+        return a->score > b->score;
+    }
+    if (a->util != b->util) {
+        return a->util > b->util;
+    }
+    return a->kops > b->kops;
+}
+
+/**
+ * @brief Replays every trace with the policy of a choice of values
+ * @param[in,out] point the choice, completed with its results
+ * @param[in] traces the traces
+ * @param[in] num_traces number of traces
+ * @param[in] weight the weight of utilization in the score
+ * @return false if the policy is invalid or the allocator failed
+ */
+static bool tune_evaluate(tune_point_t *point, const trace_t *traces,
+                          size_t num_traces, double weight) {
+    mm_policy_t policy;
+    summary_t sum;
+    result_t *res = calloc(1, sizeof(result_t));
+    bool ok = res != NULL;
+    tune_policy(point->choice, &policy);
+    if (!ok || !mm_set_policy(&policy)) {
+        free(res);
+        return false;
+    }
+    memset(&sum, 0, sizeof(sum));
+    for (size_t t = 0; t < num_traces && ok; t++) {
+        memset(res, 0, sizeof(result_t));
+        ok = replay(&traces[t], res, false, 0, NULL);
+        summary_add(&sum, &traces[t], res);
+    }
+    free(res);
+    summary_average(&sum, &point->util, &point->kops);
+    point->score = perf_index(point->util, point->kops, weight);
+    return ok;
+}
+
+/**
+ * @brief Searches the policies for the best score on the traces and prints
+ * it with the Pareto front of utilization and throughput
+ * @param[in] traces the traces
+ * @param[in] num_traces number of traces
+ * @param[in] weight the weight of utilization in the score
+ * @return false if no policy could be evaluated
+ */
+static bool tune(const trace_t *traces, size_t num_traces, double weight) {
+    tune_point_t *points = calloc(MAX_TUNE_POINTS, sizeof(tune_point_t));
+    size_t num_points = 0;
+    size_t best = MAX_TUNE_POINTS;
+    bool improved = true;
+    if (points == NULL) {
+        return false;
+    }
+    // The default: every field at its first value
+    print_tune_header();
+    if (tune_evaluate(&points[0], traces, num_traces, weight)) {
+        print_tune_point(&points[0]);
+        best = num_points++;
+    }
+    while (improved && best < MAX_TUNE_POINTS) {
+        improved = false;
+        for (size_t i = 0; i < NUM_TUNE_PARAMS; i++) {
+            tune_point_t start = points[best];
+            for (size_t v = 0; v < tune_params[i].num_values; v++) {
+                tune_point_t *point = &points[num_points];
+                bool seen = false;
+                if (num_points == MAX_TUNE_POINTS) {
+                    break;
+                }
+                memset(point, 0, sizeof(tune_point_t));
+                memcpy(point->choice, start.choice, sizeof(start.choice));
+                point->choice[i] = v;
+                for (size_t p = 0; p < num_points && !seen; p++) {
+                    seen = memcmp(points[p].choice, point->choice,
+                                  sizeof(point->choice)) == 0;
+                }
+                if (seen || !tune_evaluate(point, traces, num_traces,
+                                           weight)) {
+                    continue;
+                }
+                print_tune_point(point);
+                if (tune_better(point, &points[best])) {
+                    best = num_points;
+                    improved = true;
+                }
+                num_points++;
+            }
+        }
+    }
+    mm_set_policy(NULL);
+    if (best == MAX_TUNE_POINTS) {
+        free(points);
+        return false;
+    }
+
+    printf("\nPareto front of %zu policies (utilization vs. throughput):\n",
+           num_points);
+    print_tune_header();
+    for (size_t i = 0; i < num_points; i++) {
+        bool dominated = false;
+        for (size_t j = 0; j < num_points && !dominated; j++) {
+            dominated = points[j].util >= points[i].util &&
+                        points[j].kops >= points[i].kops &&
+                        (points[j].util > points[i].util ||
+                         points[j].kops > points[i].kops);
+        }
+        if (!dominated) {
+            print_tune_point(&points[i]);
+        }
+    }
+    printf("\nBest at %.0f%% utilization weight:\n", weight * 100.0);
+    print_tune_header();
+    print_tune_point(&points[best]);
+    free(points);
+    return true;
+}
+
+
+/*
+ * ---------------------------------------------------------------------------
+ *                              PARALLEL RUNS
+ *
+ * With -j or -r every pair of a trace and a configuration is replayed
+ * several times, by worker processes that each stay pinned to one CPU so
+ * that the scheduler does not migrate them in the middle of a run. A
+ * worker inherits the simulated heap of memlib.c through fork(), so every
+ * worker replays on a heap of its own, and a replay that crashes takes
+ * down only its worker. The workers take runs from a counter in shared
+ * memory, repetitions outermost, so that the repetitions of a pair are
+ * spread over time and CPUs, and store the results next to it.
+ *
+ * Each pair reports the median throughput of its runs with a 95%
+ * confidence interval for the median, taken from the order statistics of
+ * the runs, so that nothing is assumed about their distribution. Below 6
+ * runs no such interval exists: the whole range of the runs is reported
+ * instead, with the confidence it has (75% for 3 runs, 94% for 5), which
+ * is always printed next to the interval. The summary in the README's
+ * format is computed for each repetition, and reported as the median and
+ * interval of those. Workers running side by side share the memory bus
+ * and the last-level cache: -j 1 gives absolute numbers, more workers give
+ * comparisons sooner.
+ * ---------------------------------------------------------------------------
+ */
+
+/** @brief The result of one run, stored by the worker that did it */
+typedef struct {
+    bool done;
+    double util;
+    double secs;
+} sample_t;
+
+/** @brief The memory shared by the driver and its workers */
+typedef struct {
+    size_t next; // the next run to be taken
+    sample_t samples[];
+} shared_runs_t;
+
+/** @brief The runs of a batch */
+typedef struct {
+    const trace_t *traces;
+    size_t num_traces;
+    const config_t *configs;
+    size_t num_configs;
+    size_t repeats;
+    size_t workers; // 0: one per CPU
+} batch_t;
+
+/**
+ * @brief Replays runs of the batch until there are none left, then exits
+ * @param[in] batch the batch
+ * @param[in,out] shared the run counter and the results
+ * @param[in] cpu the CPU to stay on, or -1
+ */
+static void run_worker(const batch_t *batch, shared_runs_t *shared,
+                       int cpu) {
+    size_t num_runs = batch->repeats * batch->num_traces * batch->num_configs;
+    result_t *res = calloc(1, sizeof(result_t));
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+    while (res != NULL) {
+        size_t run = __atomic_fetch_add(&shared->next, 1, __ATOMIC_RELAXED);
+        if (run >= num_runs) {
+            break;
+        }
+        // run = (repetition * num_traces + trace) * num_configs + config
+        const config_t *config = &batch->configs[run % batch->num_configs];
+        const trace_t *trace =
+            &batch->traces[run / batch->num_configs % batch->num_traces];
+        mm_set_policy(config->policy);
+        mm_set_addr_order(config->addr_order);
+        memset(res, 0, sizeof(result_t));
+        if (replay(trace, res, false, 0, NULL)) {
+            shared->samples[run].util = res->util;
+            shared->samples[run].secs = res->secs;
+            shared->samples[run].done = true;
+        }
+    }
+    _exit(0);
+}
+
+/** @brief Orders doubles for qsort() */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/** @brief Returns P(B = k) for B ~ Binomial(n, 1/2) */
+static double half_binomial(size_t n, size_t k) {
+    return exp(lgamma((double)n + 1.0) - lgamma((double)k + 1.0) -
+               lgamma((double)(n - k) + 1.0) - (double)n * log(2.0));
+}
+
+/**
+ * @brief Computes the median of some values and a confidence interval for
+ * it, of 95% when there are enough values
+ * @param[in,out] values the values, sorted on return
+ * @param[in] n number of values, at least 1
+ * @param[out] median the median
+ * @param[out] lo the lower end of the interval
+ * @param[out] hi the upper end of the interval
+ * @return the confidence of the interval, in percent
+ */
+static double median_ci(double *values, size_t n, double *median, double *lo,
+                        double *hi) {
+    qsort(values, n, sizeof(double), compare_doubles);
+    *median = n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+    // The j-th smallest and j-th largest values miss the median when fewer
+    // than j values fall on one side of it, which has probability
+    // 2 P(B < j). The narrowest such interval with 95% confidence is taken,
+    // or the whole range when even that has less.
+    size_t j = 1;
+    double below = half_binomial(n, 0); // P(B < j)
+    while (2 * (j + 1) <= n + 1 &&
+           1.0 - 2.0 * (below + half_binomial(n, j)) >= 0.95) {
+        below += half_binomial(n, j);
+        j++;
+    }
+    *lo = values[j - 1];
+    *hi = values[n - j];
+    return 100.0 * (1.0 - 2.0 * below);
+}
+
+/**
+ * @brief Prints the medians of every pair of the batch and its summaries
+ * @param[in] batch the batch
+ * @param[in] samples its results, indexed by run
+ * @return false if a run failed
+ */
+static bool report_batch(const batch_t *batch, const sample_t *samples) {
+    double *utils = calloc(batch->repeats, sizeof(double));
+    double *kops = calloc(batch->repeats, sizeof(double));
+    double *scores = calloc(batch->repeats, sizeof(double));
+    double util, median, lo, hi, conf;
+    bool all_ok = true;
+    if (utils == NULL || kops == NULL || scores == NULL) {
+        free(utils);
+        free(kops);
+        free(scores);
+        return false;
+    }
+
+    printf("%-36s %-7s %6s %10s %10s %10s %10s %5s\n", "trace", "policy",
+           "util", "ops", "Kops", "CI low", "CI high", "conf");
+    for (size_t t = 0; t < batch->num_traces; t++) {
+        const trace_t *trace = &batch->traces[t];
+        for (size_t c = 0; c < batch->num_configs; c++) {
+            size_t n = 0;
+            for (size_t r = 0; r < batch->repeats; r++) {
+                const sample_t *sample =
+                    &samples[(r * batch->num_traces + t) * batch->num_configs +
+                             c];
+                if (sample->done) {
+                    utils[n] = sample->util;
+                    kops[n] = (double)trace->num_ops / sample->secs / 1000.0;
+                    n++;
+                }
+            }
+            if (n < batch->repeats) {
+                fprintf(stderr, "replay: %zu of %zu runs failed on %s\n",
+                        batch->repeats - n, batch->repeats, trace->name);
+                all_ok = false;
+            }
+            if (n == 0) {
+                continue;
+            }
+            median_ci(utils, n, &util, &lo, &hi);
+            conf = median_ci(kops, n, &median, &lo, &hi);
+            printf("%-36s %-7s %5.1f%% %10zu %10.0f %10.0f %10.0f %4.0f%%\n",
+                   trace->name, batch->configs[c].name, util * 100.0,
+                   trace->num_ops, median, lo, hi, conf);
+        }
+    }
+
+    printf("\n");
+    for (size_t c = 0; c < batch->num_configs; c++) {
+        size_t n = 0;
+        for (size_t r = 0; r < batch->repeats; r++) {
+            summary_t sum;
+            bool complete = true;
+            memset(&sum, 0, sizeof(sum));
+            for (size_t t = 0; t < batch->num_traces; t++) {
+                const sample_t *sample =
+                    &samples[(r * batch->num_traces + t) * batch->num_configs +
+                             c];
+                result_t res;
+                complete = complete && sample->done;
+                res.util = sample->util;
+                res.secs = sample->secs;
+                summary_add(&sum, &batch->traces[t], &res);
+            }
+            // A repetition with a failed run has no summary
+            if (complete) {
+                summary_average(&sum, &utils[n], &kops[n]);
+                scores[n] = perf_index(utils[n], kops[n], util_weight);
+                n++;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        double score;
+        median_ci(utils, n, &util, &lo, &hi);
+        median_ci(scores, n, &score, &lo, &hi);
+        conf = median_ci(kops, n, &median, &lo, &hi);
+        printf("%-7s Utilization %5.1f%%  Throughput %8.0f Kops  "
+               "Perf Index %5.1f  (Kops %.0f%% CI %.0f-%.0f, %zu runs)\n",
+               batch->configs[c].name, util * 100.0, median, score, conf, lo,
+               hi, n);
+    }
+    free(utils);
+    free(kops);
+    free(scores);
+    return all_ok;
+}
+
+/**
+ * @brief Replays every pair of the batch in worker processes and reports
+ * the results
+ * @param[in] batch the batch
+ * @return false if a run or a worker failed
+ */
+static bool run_batch(const batch_t *batch) {
+    size_t num_runs = batch->repeats * batch->num_traces * batch->num_configs;
+    size_t size = sizeof(shared_runs_t) + num_runs * sizeof(sample_t);
+    size_t workers = batch->workers;
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    size_t num_cpus = 0;
+    bool all_ok = true;
+
+    // The CPUs this process may run on, one worker each by default
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus[num_cpus++] = cpu;
+            }
+        }
+    }
+    if (workers == 0) {
+        workers = num_cpus > 0 ? num_cpus : 1;
+    }
+    if (workers > num_runs) {
+        workers = num_runs;
+    }
+
+    shared_runs_t *shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        fprintf(stderr, "replay: cannot map the results\n");
+        return false;
+    }
+    fflush(stdout);
+    for (size_t w = 0; w < workers; w++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run_worker(batch, shared, num_cpus > 0 ? cpus[w % num_cpus] : -1);
+        }
+        if (pid < 0) {
+            fprintf(stderr, "replay: fork failed\n");
+            all_ok = false;
+            break;
+        }
+    }
+    // A run taken by a worker that died is left undone, and reported
+    int status;
+    while (wait(&status) > 0) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "replay: a worker died\n");
+            all_ok = false;
+        }
+    }
+    all_ok = report_batch(batch, shared->samples) && all_ok;
+    munmap(shared, size);
+    return all_ok;
+}
+
+/**
+ * @brief Builds one configuration per policy preset named in a list
+ * @param[in] list preset names separated by commas
+ * @param[out] configs the configurations, LIFO
+ * @return the number of configurations; exits on an unknown name
+ */
+static size_t parse_policies(char *list, config_t *configs) {
+    size_t count = 0;
+    for (char *name = strtok(list, ","); name != NULL;
+         name = strtok(NULL, ",")) {
+        const mm_policy_t *policy = mm_policy_preset(name);
+        if (policy == NULL) {
+            fprintf(stderr, "replay: unknown policy %s\n", name);
+            exit(1);
+        }
+        if (count == MAX_CONFIGS) {
+            fprintf(stderr, "replay: at most %d policies\n", MAX_CONFIGS);
+            exit(1);
+        }
+        configs[count].name = policy->name;
+        configs[count].addr_order = 0;
+        configs[count].policy = policy;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Prints the usage message and exits
+ * @param[in] prog the program name
+ */
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-l] [-p] [-t] [-a | -c] [-P <policy>[,<policy>...]] "
+            "[-T [-w <weight>] | -j <n> [-r <n>]] [-k <n>] "
+            "[-H <flags>[,<n>]] [-q <bytes>] [-L <soft>[,<hard>]] [-m] "
+            "<trace.rep>...\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    bool latency = false;
+    bool perf = false;
+    counters_t counters;
+    size_t max_outliers = 8;
+    const config_t *configs = &lifo_config;
+    size_t num_configs = 1;
+    config_t policy_configs[MAX_CONFIGS];
+    summary_t summaries[MAX_CONFIGS];
+    bool all_ok = true;
+    bool tuning = false;
+    double tune_weight = util_weight;
+    bool parallel = false;
+    size_t workers = 0;
+    size_t repeats = 5;
+    unsigned int harden_flags;
+    unsigned int guard_interval;
+    size_t soft_limit;
+    char *end;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "lptacP:Tw:j:r:k:H:q:L:m")) != -1) {
+        switch (opt) {
+        case 'l':
+            latency = true;
+            break;
+        case 'p':
+            perf = true;
+            break;
+        case 't':
+            mm_set_huge_pages(true);
+            break;
+        case 'a':
+            configs = &addr_config;
+            num_configs = 1;
+            break;
+        case 'c':
+            configs = compare_configs;
+            num_configs = sizeof(compare_configs) / sizeof(config_t);
+            break;
+        case 'P':
+            num_configs = parse_policies(optarg, policy_configs);
+            configs = policy_configs;
+            break;
+        case 'T':
+            tuning = true;
+            break;
+        case 'w':
+            tune_weight = strtod(optarg, NULL);
+            if (tune_weight < 0.0 || tune_weight > 1.0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'j':
+            parallel = true;
+            workers = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            repeats = strtoul(optarg, NULL, 10);
+            if (repeats == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'k':
+            max_outliers = strtoul(optarg, NULL, 10);
+            if (max_outliers > MAX_OUTLIERS) {
+                max_outliers = MAX_OUTLIERS;
+            }
+            break;
+        case 'H':
+            // MM_HARDEN_* flags, optionally ",<guard interval>"
+            harden_flags = (unsigned int)strtoul(optarg, &end, 0);
+            guard_interval =
+                *end == ',' ? (unsigned int)strtoul(end + 1, NULL, 10) : 0;
+            mm_set_hardening(harden_flags, guard_interval);
+            break;
+        case 'q':
+            mm_set_quarantine(strtoul(optarg, NULL, 0));
+            break;
+        case 'L':
+            soft_limit = strtoul(optarg, &end, 0);
+            mm_set_heap_limit(soft_limit,
+                              *end == ',' ? strtoul(end + 1, NULL, 0) : 0);
+            break;
+        case 'm':
+            maintenance = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    // Workers report neither latencies nor counters, and fork() does not
+    // copy the maintenance thread
+    if (optind == argc ||
+        (parallel && (tuning || latency || perf || maintenance))) {
+        usage(argv[0]);
+    }
+
+    if (perf && !counters_open(&counters)) {
+        fprintf(stderr, "replay: perf_event_open failed, check "
+                        "/proc/sys/kernel/perf_event_paranoid\n");
+        perf = false;
+    }
+
+    mem_init();
+    if (tuning || parallel) {
+        size_t num_names = (size_t)(argc - optind);
+        trace_t *traces;
+        size_t num_traces = load_traces(&argv[optind], num_names, &traces);
+        all_ok = num_traces == num_names;
+        if (tuning) {
+            mm_set_addr_order(configs[0].addr_order);
+            all_ok = tune(traces, num_traces, tune_weight) && all_ok;
+        } else {
+            batch_t batch = {traces,      num_traces, configs,
+                             num_configs, repeats,    workers};
+            all_ok = run_batch(&batch) && all_ok;
+        }
+        free_traces(traces, num_traces);
+        mm_set_maintenance(false);
+        mem_deinit();
+        return all_ok ? 0 : 1;
+    }
+    memset(summaries, 0, sizeof(summaries));
+    printf("%-36s %-7s %6s %10s %10s %10s\n", "trace", "policy", "util",
+           "ops", "secs", "Kops");
+    for (int i = optind; i < argc; i++) {
+        trace_t trace;
+        result_t *res = calloc(1, sizeof(result_t));
+        if (res == NULL || !load_trace(argv[i], &trace)) {
+            free(res);
+            all_ok = false;
+            continue;
+        }
+        for (size_t c = 0; c < num_configs; c++) {
+            mm_set_policy(configs[c].policy);
+            mm_set_addr_order(configs[c].addr_order);
+            memset(res, 0, sizeof(result_t));
+            if (!replay(&trace, res, false, 0, perf ? &counters : NULL)) {
+                all_ok = false;
+                continue;
+            }
+            double kops = (double)trace.num_ops / res->secs / 1000.0;
+            printf("%-36s %-7s %5.1f%% %10zu %10.6f %10.0f\n", trace.name,
+                   configs[c].name, res->util * 100.0, trace.num_ops,
+                   res->secs, kops);
+            if (perf) {
+                print_counters(&trace, res);
+            }
+            summary_add(&summaries[c], &trace, res);
+
+            if (latency) {
+                memset(res, 0, sizeof(result_t));
+                if (replay(&trace, res, true, max_outliers, NULL)) {
+                    print_latency(&trace, res);
+                }
+            }
+        }
+        free(trace.ops);
+        free(res);
+    }
+
+    printf("\n");
+    for (size_t c = 0; c < num_configs; c++) {
+        print_summary(&configs[c], &summaries[c]);
+    }
+    if (perf) {
+        counters_close(&counters);
+    }
+    // The thread must be done with the heap before it goes away
+    mm_set_maintenance(false);
+    mem_deinit();
+    return all_ok ? 0 : 1;
+}
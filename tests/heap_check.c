@@ -0,0 +1,297 @@
+/**
+ * @file heap_check.c
+ * @brief Replays traces on libmm.so under policies at the edge of what
+ * mm_set_policy() accepts
+ *
+ * Policies whose tree class starts at blocks too small for its three links
+ * must be rejected. The smallest policies that are accepted each get a fresh
+ * heap from mm_init() and replay every trace given: each block is filled
+ * with a byte derived from its id and checked before it is reallocated or
+ * freed, so that links written over a neighbor's data end the test, and
+ * mm_checkheap() checks the whole heap every check_interval requests.
+ *
+ * mm_try_expand() must grow a block into free space after it or at the end
+ * of the heap, and otherwise fail without changing a byte of the heap. Last,
+ * each preset fills a heap with a hard limit, which must be used up to the
+ * last request that fits whatever the growth of the preset.
+ *
+ *   heap_check <trace.rep>...
+ *
+ * Links against libmm.so, which replaces malloc() in the whole program (see
+ * heap_check.sh).
+ *
+ * @author Yi-Jing <ysie@andrew.cmu.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "memlib_os.h"
+#include "mm_ext.h"
+
+/** @brief Requests between two calls to mm_checkheap() */
+static const size_t check_interval = 64;
+
+/** @brief Room under the hard limit of fill_to_limit() */
+static const size_t limit_room = 50 << 20;
+
+/** @brief Size of the requests of fill_to_limit() */
+static const size_t limit_request = 100000;
+
+/** @brief Policies whose tree starts below 40 bytes, too small for the
+ * three 8-byte links of the default block layout */
+static const mm_policy_t bad_policies[] = {
+    {"tree16", 4, 1, 2, 0, (1 << 12), 0, true},
+    {"tree32", 5, 1, 2, 0, (1 << 12), 0, true},
+    {"tree32s", 4, 1, 3, 0, (1 << 12), 0, true},
+    {"tree24", 4, 2, 3, 0, (1 << 12), 0, true},
+    {"tree32q", 4, 4, 6, 4, (1 << 12), 0, false},
+};
+
+/** @brief The smallest trees that hold three links */
+static const mm_policy_t good_policies[] = {
+    {"tree40", 4, 4, 7, 4, (1 << 12), 0, true},
+    {"tree64", 6, 1, 2, 0, (1 << 12), 0, false},
+    {"tree64g", 5, 1, 3, 16, (1 << 12), 3, true},
+};
+
+/** @brief The fill byte of the block of an id */
+static char fill_of(size_t id) {
+    return (char)(id * 7 + 1);
+}
+
+/**
+ * @brief Checks that a block still holds the fill byte of its id
+ * @return false, after a report, if it does not
+ */
+static bool check_block(const char *trace, const char *block, size_t size,
+                        size_t id) {
+    for (size_t i = 0; i < size; i++) {
+        if (block[i] != fill_of(id)) {
+            fprintf(stderr, "heap_check: %s: block %zu corrupted at byte %zu\n",
+                    trace, id, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Replays a trace on the current heap
+ * @param[in] name the path of the .rep file
+ * @return false, after a report, on a bad trace, a failed allocation or a
+ * corrupted block
+ */
+static bool replay(const char *name) {
+    FILE *fp = fopen(name, "r");
+    int weight;
+    size_t num_ids, num_ops;
+    unsigned long max_alloc;
+    if (fp == NULL || fscanf(fp, "%d %zu %zu %lu", &weight, &num_ids,
+                             &num_ops, &max_alloc) != 4) {
+        fprintf(stderr, "heap_check: cannot read %s\n", name);
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return false;
+    }
+    char **blocks = calloc(num_ids, sizeof(char *));
+    size_t *sizes = calloc(num_ids, sizeof(size_t));
+    bool ok = blocks != NULL && sizes != NULL;
+    for (size_t i = 0; i < num_ops && ok; i++) {
+        char type;
+        size_t id, size = 0;
+        if (fscanf(fp, " %c %zu", &type, &id) != 2 || id >= num_ids ||
+            (type != 'f' && fscanf(fp, "%zu", &size) != 1)) {
+            fprintf(stderr, "heap_check: bad request %zu in %s\n", i, name);
+            ok = false;
+            break;
+        }
+        ok = check_block(name, blocks[id], sizes[id], id);
+        if (type == 'f') {
+            free(blocks[id]);
+            blocks[id] = NULL;
+            sizes[id] = 0;
+        } else {
+            size_t kept = size < sizes[id] ? size : sizes[id];
+            char *block =
+                type == 'a' ? malloc(size) : realloc(blocks[id], size);
+            if (block == NULL && size != 0) {
+                fprintf(stderr, "heap_check: %s: out of memory\n", name);
+                ok = false;
+                break;
+            }
+            blocks[id] = block;
+            sizes[id] = block != NULL ? size : 0;
+            ok = ok && (type == 'a' || check_block(name, block, kept, id));
+            if (block != NULL) {
+                memset(block, fill_of(id), size);
+            }
+        }
+        if (i % check_interval == 0 && !mm_checkheap(__LINE__)) {
+            ok = false;
+        }
+    }
+    for (size_t id = 0; blocks != NULL && id < num_ids; id++) {
+        free(blocks[id]);
+    }
+    free(blocks);
+    free(sizes);
+    fclose(fp);
+    return mm_checkheap(__LINE__) && ok;
+}
+
+/**
+ * @brief Checks that mm_try_expand() fails and leaves the heap as it was
+ * @param[in] block the payload to grow
+ * @param[in] size the size it cannot grow to
+ * @return false, after a report, if it grew or the heap changed
+ */
+static bool expand_fails(char *block, size_t size) {
+    char *lo = mem_heap_lo();
+    size_t heap_size = mem_heapsize();
+    // A copy outside the heap, which malloc() would change
+    char *copy = mmap(NULL, heap_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED) {
+        fprintf(stderr, "heap_check: cannot copy the heap\n");
+        return false;
+    }
+    memcpy(copy, lo, heap_size);
+    bool expanded = mm_try_expand(block, size);
+    bool same = mem_heapsize() == heap_size &&
+                memcmp(copy, lo, heap_size) == 0;
+    munmap(copy, heap_size);
+    if (expanded || !same) {
+        fprintf(stderr, "heap_check: mm_try_expand(%zu) %s\n", size,
+                expanded ? "grew a block that cannot grow"
+                         : "failed but changed the heap");
+        return false;
+    }
+    return mm_checkheap(__LINE__);
+}
+
+/**
+ * @brief Checks that mm_try_expand() grows a block in place
+ * @param[in] block the payload to grow
+ * @param[in] size the size it must grow to
+ * @return false, after a report, if it did not
+ */
+static bool expand_grows(char *block, size_t size) {
+    if (!mm_try_expand(block, size) || mm_usable_size(block) < size) {
+        fprintf(stderr, "heap_check: mm_try_expand(%zu) failed\n", size);
+        return false;
+    }
+    return mm_checkheap(__LINE__);
+}
+
+/**
+ * @brief Grows blocks with mm_try_expand() into an allocated neighbor, a
+ * free one and the end of the heap, with and without room under a hard
+ * limit
+ * @return false, after a report, if a case went wrong
+ */
+static bool check_try_expand(void) {
+    if (!mm_set_policy(NULL) || !mm_init()) {
+        fprintf(stderr, "heap_check: cannot start a heap\n");
+        return false;
+    }
+    char *a = malloc(1000);
+    char *b = malloc(1000);
+    char *c = malloc(1000);
+    if (a == NULL || b == NULL || c == NULL) {
+        fprintf(stderr, "heap_check: out of memory\n");
+        return false;
+    }
+    memset(a, 'a', 1000);
+    memset(c, 'c', 1000);
+    // Behind an allocated block, then a free one too small, then one that
+    // is large enough
+    bool ok = expand_fails(a, 1500);
+    free(b);
+    ok = ok && expand_fails(a, 5000) && expand_grows(a, 1900);
+    // c ends the heap, which may not grow at all, then by less than a chunk
+    size_t end = (size_t)((char *)mem_heap_hi() + 1 - c);
+    mm_set_heap_limit(0, mem_heapsize());
+    ok = ok && expand_fails(c, end + 100);
+    mm_set_heap_limit(0, mem_heapsize() + 512);
+    ok = ok && expand_grows(c, end + 100);
+    mm_set_heap_limit(0, 0);
+    for (size_t i = 0; i < 1000 && ok; i++) {
+        ok = a[i] == 'a' && c[i] == 'c';
+    }
+    if (!ok) {
+        fprintf(stderr, "heap_check: mm_try_expand() checks failed\n");
+    }
+    free(a);
+    free(c);
+    return ok;
+}
+
+/**
+ * @brief Allocates until a heap with a hard limit is full
+ * @param[in] preset the name of the policy preset
+ * @return false, after a report, if more than two requests' worth of the
+ * limit was left unused
+ */
+static bool fill_to_limit(const char *preset) {
+    if (!mm_set_policy(mm_policy_preset(preset)) || !mm_init()) {
+        fprintf(stderr, "heap_check: cannot start a %s heap\n", preset);
+        return false;
+    }
+    // Heaps started before are still part of mem_heapsize()
+    mm_set_heap_limit(0, mem_heapsize() + limit_room);
+    size_t used = 0;
+    while (malloc(limit_request) != NULL) {
+        used += limit_request;
+    }
+    mm_set_heap_limit(0, 0);
+    if (used + 2 * limit_request < limit_room) {
+        fprintf(stderr, "heap_check: %s heap full at %zu of %zu bytes\n",
+                preset, used, limit_room);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    size_t num_bad = sizeof(bad_policies) / sizeof(bad_policies[0]);
+    size_t num_good = sizeof(good_policies) / sizeof(good_policies[0]);
+    for (size_t p = 0; p < num_bad; p++) {
+        if (mm_set_policy(&bad_policies[p])) {
+            fprintf(stderr, "heap_check: policy %s was accepted\n",
+                    bad_policies[p].name);
+            return 1;
+        }
+    }
+    if (!check_try_expand()) {
+        return 1;
+    }
+    for (size_t p = 0; p < num_good; p++) {
+        // Every other heap keeps its lists in address order
+        mm_set_addr_order(p % 2 != 0 ? MM_ADDR_ORDER_ALL : 0);
+        if (!mm_set_policy(&good_policies[p]) || !mm_init()) {
+            fprintf(stderr, "heap_check: policy %s was refused\n",
+                    good_policies[p].name);
+            return 1;
+        }
+        for (int t = 1; t < argc; t++) {
+            if (!replay(argv[t])) {
+                fprintf(stderr, "heap_check: failed under policy %s\n",
+                        good_policies[p].name);
+                return 1;
+            }
+        }
+    }
+    mm_set_addr_order(0);
+    const char *presets[] = {"default", "fine", "fast"};
+    for (size_t p = 0; p < sizeof(presets) / sizeof(presets[0]); p++) {
+        if (!fill_to_limit(presets[p])) {
+            return 1;
+        }
+    }
+    printf("heap_check: ok\n");
+    return 0;
+}
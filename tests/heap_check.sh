@@ -0,0 +1,26 @@
+#!/bin/sh
+# Builds libmm.so and heap_check.c, and replays a few traces under the
+# smallest policies mm_set_policy() accepts, then fills heaps with a hard
+# limit. mm_try_expand() is checked to leave the heap as it was when it fails.
+#
+#   tests/heap_check.sh [libmm.so]
+#
+# An existing libmm.so can be given instead of building one.
+set -e
+cd "$(dirname "$0")/.."
+# The checks expect the default settings of the library
+unset MM_HARDEN MM_QUARANTINE MM_THP MM_POLICY MM_NUMA MM_LIMIT MM_MAINT \
+    MM_IMAGE MM_SHM
+CC=${CC:-gcc}
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+lib=${1:-$build/libmm.so}
+if [ $# -eq 0 ] &&
+    ! $CC -O2 -fPIC -shared -DLIBMM -o "$lib" mm.c memlib_os.c -lpthread; then
+    echo "heap_check.sh: cannot build libmm.so with $CC" >&2
+    exit 1
+fi
+case $lib in /*) ;; *) lib=$PWD/$lib ;; esac
+$CC -O2 -I. -o "$build/heap_check" tests/heap_check.c "$lib" -lpthread
+"$build/heap_check" traces/syn-mix-realloc.rep traces/bdd-aa4.rep \
+    traces/ngram-gulliver1.rep traces/syn-struct-short.rep
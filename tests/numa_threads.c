@@ -0,0 +1,122 @@
+/**
+ * @file numa_threads.c
+ * @brief Threaded malloc/realloc/free check for the NUMA arenas of libmm.so
+ *
+ * Threads share a table of slots and, each slot under its own lock, allocate
+ * blocks, grow and shrink them with realloc() and free them, so that blocks
+ * move between the arenas of different threads all the time. Every block is
+ * filled with a byte derived from its slot, checked before it changes hands,
+ * and a corrupted block or a failed allocation ends the test.
+ *
+ * Meant to run preloaded with MM_NUMA=<arenas>; with more arenas than the
+ * machine has nodes, threads are spread over them by thread id, so a
+ * single-node machine exercises the cross-arena paths too (see
+ * numa_threads.sh).
+ *
+ * @author Yi-Jing <ysie@andrew.cmu.edu>
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** @brief Number of threads */
+#define NUM_THREADS 8
+
+/** @brief Number of shared slots */
+#define NUM_SLOTS 512
+
+/** @brief Operations per thread */
+static const int num_ops = 200000;
+
+/** @brief Largest block requested (bytes) */
+static const size_t max_request = 3000;
+
+static char *slot_block[NUM_SLOTS];
+static size_t slot_size[NUM_SLOTS];
+static pthread_mutex_t slot_lock[NUM_SLOTS];
+
+/**
+ * @brief Checks that the first `size` bytes of a slot's block still hold its
+ * fill byte, and exits otherwise
+ */
+static void check_block(int slot, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        if (slot_block[slot][i] != (char)slot) {
+            fprintf(stderr, "numa_threads: slot %d corrupted at byte %zu\n",
+                    slot, i);
+            exit(1);
+        }
+    }
+}
+
+/**
+ * @brief Exits if an allocation failed
+ * @param[in] bp the result of malloc() or realloc()
+ */
+static void check_alloc(void *bp) {
+    if (bp == NULL) {
+        fprintf(stderr, "numa_threads: out of memory\n");
+        exit(1);
+    }
+}
+
+/**
+ * @brief Runs random operations on the shared slots
+ * @param[in] arg the seed of the thread
+ */
+static void *worker(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    for (int op = 0; op < num_ops; op++) {
+        int slot = rand_r(&seed) % NUM_SLOTS;
+        size_t size = 1 + (size_t)rand_r(&seed) % max_request;
+        pthread_mutex_lock(&slot_lock[slot]);
+        if (slot_block[slot] == NULL) {
+            slot_block[slot] = malloc(size);
+            check_alloc(slot_block[slot]);
+            memset(slot_block[slot], slot, size);
+            slot_size[slot] = size;
+        } else if (rand_r(&seed) % 3 == 0) {
+            check_block(slot, slot_size[slot]);
+            free(slot_block[slot]);
+            slot_block[slot] = NULL;
+        } else {
+            // Grows or shrinks, in place or by moving
+            check_block(slot, slot_size[slot]);
+            slot_block[slot] = realloc(slot_block[slot], size);
+            check_alloc(slot_block[slot]);
+            size_t kept = size < slot_size[slot] ? size : slot_size[slot];
+            check_block(slot, kept);
+            memset(slot_block[slot], slot, size);
+            slot_size[slot] = size;
+        }
+        pthread_mutex_unlock(&slot_lock[slot]);
+    }
+    return NULL;
+}
+
+int main(void) {
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        pthread_mutex_init(&slot_lock[i], NULL);
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, worker,
+                           (void *)(size_t)(i + 1)) != 0) {
+            fprintf(stderr, "numa_threads: cannot create threads\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < NUM_SLOTS; i++) {
+        if (slot_block[i] != NULL) {
+            check_block(i, slot_size[i]);
+            free(slot_block[i]);
+        }
+    }
+    printf("numa_threads: ok\n");
+    return 0;
+}
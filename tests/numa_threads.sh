@@ -0,0 +1,25 @@
+#!/bin/sh
+# Builds libmm.so and numa_threads.c, and runs the check on a single heap
+# and on NUMA arenas: one per node, then 4 simulated by thread id, which
+# any machine can run.
+#
+#   tests/numa_threads.sh [libmm.so]
+#
+# An existing libmm.so can be given instead of building one.
+set -e
+cd "$(dirname "$0")/.."
+CC=${CC:-gcc}
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+lib=${1:-$build/libmm.so}
+if [ $# -eq 0 ] &&
+    ! $CC -O2 -fPIC -shared -DLIBMM -o "$lib" mm.c memlib_os.c -lpthread; then
+    echo "numa_threads.sh: cannot build libmm.so with $CC" >&2
+    exit 1
+fi
+case $lib in /*) ;; *) lib=$PWD/$lib ;; esac
+$CC -O2 -o "$build/numa_threads" tests/numa_threads.c -lpthread
+for arenas in 0 1 4; do
+    echo "MM_NUMA=$arenas"
+    MM_NUMA=$arenas LD_PRELOAD=$lib "$build/numa_threads"
+done